@@ -0,0 +1,287 @@
+#include "bench.h"
+#include "platform.h"
+
+// Runs of an empty operation taken to measure the stopwatch's own overhead
+#define OVERHEAD_RUNS 16
+
+// Benchmarks run for an empty request
+static const struct {
+    uint8_t kind;
+    uint16_t size;
+} default_set[] = {
+    {BENCH_CRC, 64},       {BENCH_CRC, 1024},     {BENCH_ENCODE, 64},
+    {BENCH_ENCODE, 1024},  {BENCH_DECODE, 64},    {BENCH_DECODE, 1024},
+    {BENCH_DISPATCH, 7},   {BENCH_DISPATCH, 64},
+};
+
+// Frame or buffer the operation under test works on
+static uint8_t buffer[PROTOCOL_MAX_FRAME_SIZE];
+static uint16_t buffer_size;
+// Connection the frames are encoded, parsed and dispatched on, so the device
+// link is left alone
+static struct protocol_conn conn;
+// Keeps results the compiler could otherwise drop
+static volatile uint8_t sink;
+
+static int discard(void *io, const uint8_t *data, size_t len) { return len; }
+
+static void empty_handler(const uint8_t *payload, size_t payload_length) {}
+
+static void op_none(void) {}
+
+static void op_crc(void) { sink = compute_crc(buffer, buffer_size); }
+
+static void op_encode(void) {
+    protocol_conn_send_typed(&conn, 'd', buffer + 5, buffer_size - 7);
+}
+
+static void op_decode(void) {
+    struct protocol_frame frame;
+    protocol_conn_parse(&conn, buffer, buffer_size, &frame);
+    sink = frame.error;
+}
+
+static void op_dispatch(void) {
+    protocol_conn_dispatch(&conn, buffer, buffer_size);
+}
+
+/**
+ * @brief Builds a frame of the given type in the benchmark buffer.
+ *
+ * @param type Frame type byte.
+ * @param size Length of the whole frame.
+ */
+static void build_frame(uint8_t type, uint16_t size) {
+    // Fill the payload in place; the encoder moves it as needed
+    for (size_t i = 5; i + 2 < size; i++) {
+        buffer[i] = i;
+    }
+    protocol_encode_frame(buffer, type, buffer + 5, size - 7);
+}
+
+/**
+ * @brief Finds a frame type without a handler and registers an empty one.
+ *
+ * @return The type, or -1 if every type is taken.
+ */
+static int claim_free_type(void) {
+    for (int type = 0xFF; type >= 0; type--) {
+        if (protocol_get_handler(type) == NULL &&
+            protocol_register_handler(type, PROTOCOL_ANY_SIZE,
+                                      empty_handler) == 0) {
+            return type;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Times one run of an operation.
+ *
+ * @param op The operation.
+ * @return The stopwatch ticks it took.
+ */
+static uint32_t time_once(void (*op)(void)) {
+    platform_stopwatch_start();
+    op();
+    return platform_stopwatch_ticks();
+}
+
+/**
+ * @brief Runs one benchmark.
+ *
+ * @param kind What to measure, from enum bench_kind.
+ * @param size Bytes the operation works on.
+ * @param iterations Number of runs, or 0 for BENCH_DEFAULT_ITERATIONS.
+ * @param result Set to the timing; its iteration count is 0 if the
+ *        benchmark could not run.
+ * @return false if the kind is unknown or the size out of range.
+ *
+ * @note Each run is timed on its own, so the fastest run shows the cost of
+ *       the code without interrupts, while the slowest run and the total
+ *       include them. The time of timing an empty operation is taken off
+ *       every run. A run that overflows the stopwatch is counted as wrapped
+ *       and left out of the timings.
+ */
+bool bench_run(uint8_t kind, uint16_t size, uint16_t iterations,
+               struct bench_result *result) {
+    result->kind = kind;
+    result->size = size;
+    result->iterations = 0;
+    result->wrapped = 0;
+    result->min_ticks = 0;
+    result->max_ticks = 0;
+    result->total_ticks = 0;
+    // Frames need at least a header and footer, and must fit the parser
+    uint16_t min_size = kind == BENCH_CRC ? 1 : 7;
+    if (kind >= BENCH_KIND_COUNT || size < min_size ||
+        size > PROTOCOL_MAX_FRAME_SIZE) {
+        return false;
+    }
+    if (iterations == 0) {
+        iterations = BENCH_DEFAULT_ITERATIONS;
+    }
+
+    protocol_conn_init(&conn, discard, NULL);
+    protocol_conn_set_flush_deadline(&conn, 0);
+    buffer_size = size;
+    int dispatch_type = -1;
+    void (*op)(void) = op_crc;
+    switch (kind) {
+    case BENCH_CRC:
+        for (size_t i = 0; i < size; i++) {
+            buffer[i] = i;
+        }
+        break;
+    case BENCH_ENCODE:
+        build_frame('d', size);
+        op = op_encode;
+        break;
+    case BENCH_DECODE:
+        build_frame('d', size);
+        op = op_decode;
+        break;
+    case BENCH_DISPATCH:
+        dispatch_type = claim_free_type();
+        if (dispatch_type < 0) {
+            return false;
+        }
+        build_frame(dispatch_type, size);
+        op = op_dispatch;
+        break;
+    }
+
+    uint32_t overhead = UINT32_MAX;
+    for (int i = 0; i < OVERHEAD_RUNS; i++) {
+        uint32_t ticks = time_once(op_none);
+        if (ticks < overhead) {
+            overhead = ticks;
+        }
+    }
+    uint16_t wrapped = 0;
+    uint32_t min_ticks = UINT32_MAX;
+    uint32_t max_ticks = 0;
+    uint64_t total_ticks = 0;
+    for (uint16_t i = 0; i < iterations; i++) {
+        uint32_t ticks = time_once(op);
+        if (ticks == UINT32_MAX) {
+            wrapped++;
+            continue;
+        }
+        ticks = ticks > overhead ? ticks - overhead : 0;
+        if (ticks < min_ticks) {
+            min_ticks = ticks;
+        }
+        if (ticks > max_ticks) {
+            max_ticks = ticks;
+        }
+        total_ticks += ticks;
+    }
+
+    if (dispatch_type >= 0) {
+        protocol_register_handler(dispatch_type, 0, NULL);
+    }
+    result->iterations = iterations;
+    result->wrapped = wrapped;
+    result->min_ticks = wrapped < iterations ? min_ticks : 0;
+    result->max_ticks = max_ticks;
+    result->total_ticks = total_ticks;
+    return true;
+}
+
+/**
+ * @brief Runs the benchmarks of a request.
+ *
+ * @param request Records of BENCH_REQUEST_SIZE bytes, or NULL for the
+ *        default set.
+ * @param request_length Length of the request, 0 for the default set.
+ * @param results Array of at least BENCH_MAX results.
+ * @return The number of results.
+ *
+ * @note Records past BENCH_MAX and a trailing partial record are ignored.
+ */
+size_t bench_run_set(const uint8_t *request, size_t request_length,
+                     struct bench_result *results) {
+    size_t count = 0;
+    if (request_length == 0) {
+        for (; count < sizeof(default_set) / sizeof(default_set[0]); count++) {
+            bench_run(default_set[count].kind, default_set[count].size, 0,
+                      &results[count]);
+        }
+        return count;
+    }
+    for (; count < BENCH_MAX &&
+           (count + 1) * BENCH_REQUEST_SIZE <= request_length;
+         count++) {
+        const uint8_t *record = request + count * BENCH_REQUEST_SIZE;
+        bench_run(record[0], record[1] | record[2] << 8,
+                  record[3] | record[4] << 8, &results[count]);
+    }
+    return count;
+}
+
+/**
+ * @brief Writes a value little-endian.
+ *
+ * @param out Where to write.
+ * @param value The value.
+ * @param size Number of bytes.
+ * @return Pointer past the written bytes.
+ */
+static uint8_t *put_le(uint8_t *out, uint64_t value, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        *out++ = value >> (8 * i);
+    }
+    return out;
+}
+
+/**
+ * @brief Encodes results as the payload of a 'b' reply.
+ *
+ * @param results The results.
+ * @param count Number of results.
+ * @param payload Buffer of at least BENCH_RESULTS_HEADER_SIZE +
+ *        count * BENCH_RESULT_SIZE bytes.
+ * @return The payload length.
+ */
+size_t bench_encode_results(const struct bench_result *results, size_t count,
+                            uint8_t *payload) {
+    uint8_t *out = put_le(payload, platform_stopwatch_hz(), 4);
+    for (size_t i = 0; i < count; i++) {
+        out = put_le(out, results[i].kind, 1);
+        out = put_le(out, results[i].size, 2);
+        out = put_le(out, results[i].iterations, 2);
+        out = put_le(out, results[i].wrapped, 2);
+        out = put_le(out, results[i].min_ticks, 4);
+        out = put_le(out, results[i].max_ticks, 4);
+        out = put_le(out, results[i].total_ticks, 8);
+    }
+    return out - payload;
+}
+
+/**
+ * @brief Handles a benchmark command.
+ *
+ * @param conn The connection the command arrived on.
+ * @param payload Records of BENCH_REQUEST_SIZE bytes, empty for the default
+ *        set.
+ * @param payload_length Length of the payload.
+ *
+ * @note A payload that is not a whole number of records, or asks for more
+ *       than BENCH_MAX benchmarks, is answered with a LENGTH
+ *       acknowledgement.
+ */
+void run_benchmarks(struct protocol_conn *conn, const uint8_t *payload,
+                    size_t payload_length) {
+    if (payload_length % BENCH_REQUEST_SIZE != 0 ||
+        payload_length / BENCH_REQUEST_SIZE > BENCH_MAX) {
+        protocol_conn_send_ack(conn, LENGTH);
+        return;
+    }
+    static struct bench_result results[BENCH_MAX];
+    static uint8_t reply[BENCH_RESULTS_HEADER_SIZE +
+                         BENCH_MAX * BENCH_RESULT_SIZE];
+    size_t count = bench_run_set(payload, payload_length, results);
+    size_t reply_length = bench_encode_results(results, count, reply);
+    protocol_conn_send_typed(conn, 'b', reply, reply_length);
+}
@@ -0,0 +1,74 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "protocol.h"
+
+// Microbenchmarks run by the 'b' command. The size is that of the buffer
+// for BENCH_CRC and of the whole frame for the others.
+enum bench_kind {
+    // compute_crc over size bytes
+    BENCH_CRC = 0,
+    // Building a frame and writing it through a connection
+    BENCH_ENCODE = 1,
+    // Parsing and checking a frame fed in one chunk
+    BENCH_DECODE = 2,
+    // Dispatching a frame to a handler that does nothing
+    BENCH_DISPATCH = 3,
+};
+
+// Number of kinds in enum bench_kind.
+#define BENCH_KIND_COUNT 4
+
+// Most benchmarks one 'b' frame can ask for.
+#define BENCH_MAX 16
+
+// Iterations run when a request asks for 0.
+#define BENCH_DEFAULT_ITERATIONS 100
+
+// Bytes per benchmark in a 'b' request: kind, size (2 bytes) and iterations
+// (2 bytes), little-endian.
+#define BENCH_REQUEST_SIZE 5
+
+// Bytes in front of the results in a 'b' reply: the stopwatch rate in Hz
+// (4 bytes).
+#define BENCH_RESULTS_HEADER_SIZE 4
+
+// Bytes per benchmark in a 'b' reply: kind, size (2 bytes), iterations
+// (2 bytes), wrapped runs (2 bytes), fastest run (4 bytes), slowest run
+// (4 bytes) and total of the runs that did not wrap (8 bytes), all
+// little-endian.
+#define BENCH_RESULT_SIZE 23
+
+// Timing of one benchmark.
+struct bench_result {
+    uint8_t kind;
+    uint16_t size;
+    // Iterations run, 0 if the kind is unknown or the size out of range
+    uint16_t iterations;
+    // Runs that took longer than the stopwatch can count, left out of the
+    // times below
+    uint16_t wrapped;
+    // Fastest, slowest and total time in stopwatch ticks, without the time
+    // the stopwatch itself takes
+    uint32_t min_ticks;
+    uint32_t max_ticks;
+    uint64_t total_ticks;
+};
+
+// Runs one benchmark. Returns false if the kind is unknown or the size out of
+// range.
+bool bench_run(uint8_t kind, uint16_t size, uint16_t iterations,
+               struct bench_result *result);
+// Runs the benchmarks a 'b' request asks for, or the default set if it is
+// empty. Returns the number of results, at most BENCH_MAX.
+size_t bench_run_set(const uint8_t *request, size_t request_length,
+                     struct bench_result *results);
+// Encodes results as the payload of a 'b' reply. Returns its length.
+size_t bench_encode_results(const struct bench_result *results, size_t count,
+                            uint8_t *payload);
+// Handles a 'b' frame: runs the benchmarks and sends the results back on the
+// connection as one 'b' frame.
+void run_benchmarks(struct protocol_conn *conn, const uint8_t *payload,
+                    size_t payload_length);
+
+#endif
@@ -0,0 +1,96 @@
+"""Benchmarks generated Python codecs against hand-written struct packing.
+
+The telemetry codec is generated from schemas/telemetry.schema on the fly, so
+the benchmark always measures what schemagen.py currently emits.
+
+Usage:
+
+    python3 bench_schema.py
+"""
+
+import os
+import struct
+import timeit
+import types
+
+import schemagen
+
+ROUNDS = 100000
+SCHEMA = os.path.join(os.path.dirname(os.path.abspath(__file__)), "schemas", "telemetry.schema")
+
+
+def load_codecs():
+    """Generate and import the telemetry codecs.
+
+    Returns:
+        module: The generated module.
+    """
+    with open(SCHEMA) as f:
+        messages = schemagen.parse(f.read(), SCHEMA)
+    module = types.ModuleType("telemetry")
+    exec(schemagen.generate_py(messages), module.__dict__)
+    return module
+
+
+def encode_by_hand(timestamp_us, temperature, voltage_mv, current, flags, label):
+    """Pack a telemetry payload field by field, as done before schemas."""
+    return (
+        struct.pack("<I", timestamp_us)
+        + struct.pack("<h", temperature)
+        + struct.pack("<H", voltage_mv)
+        + struct.pack("<f", current)
+        + struct.pack("<B", flags)
+        + bytes(label)
+    )
+
+
+def decode_by_hand(payload):
+    """Unpack a telemetry payload field by field, as done before schemas."""
+    timestamp_us = struct.unpack("<I", payload[0:4])[0]
+    temperature = struct.unpack("<h", payload[4:6])[0]
+    voltage_mv = struct.unpack("<H", payload[6:8])[0]
+    current = struct.unpack("<f", payload[8:12])[0]
+    flags = payload[12]
+    label = tuple(payload[13:21])
+    return timestamp_us, temperature, voltage_mv, current, flags, label
+
+
+def rate(statement, globals):
+    """Return the number of calls per second of a statement."""
+    seconds = timeit.timeit(statement, number=ROUNDS, globals=globals)
+    return ROUNDS / seconds
+
+
+def main():
+    telemetry = load_codecs()
+    Telemetry = telemetry.Telemetry
+    fields = (123456, -40, 3300, 0.5, 1, tuple(b"abcdefgh"))
+    message = Telemetry(*fields)
+    payload = message.encode()
+    assert payload == encode_by_hand(*fields)
+    assert Telemetry.decode(payload) == decode_by_hand(payload)
+
+    # A receive buffer holding a frame header before the payload
+    frame = memoryview(b"\xaa\x00\x1c\x02T" + payload + b"\x00\xbb")
+    names = {
+        "Telemetry": Telemetry,
+        "message": message,
+        "payload": payload,
+        "frame": frame,
+        "fields": fields,
+        "encode_by_hand": encode_by_hand,
+        "decode_by_hand": decode_by_hand,
+    }
+
+    print(f"{Telemetry.SIZE} byte telemetry messages, thousands of messages per second")
+    print(f"{'method':<12} {'encode':>10} {'decode':>10}")
+    rows = [
+        ("generated", "message.encode()", "Telemetry.decode(frame, 5)"),
+        ("by hand", "encode_by_hand(*fields)", "decode_by_hand(payload)"),
+    ]
+    for name, encode, decode in rows:
+        print(f"{name:<12} {rate(encode, names) / 1000:>10.0f} {rate(decode, names) / 1000:>10.0f}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,135 @@
+#include "platform_host.h"
+#include "protocol.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * Measures write coalescing with bursts of 2 byte data frames, the pattern
+ * run_tests() and telemetry code produce. Every transport write goes to
+ * /dev/null through a real write() call, so the per-write cost of a syscall
+ * stands in for the per-packet cost of USB.
+ *
+ * For each flush deadline it reports:
+ *  - throughput of back to back frames and the number of transport writes
+ *  - latency added by the buffer for bursts of 20 frames sent every 2 ms,
+ *    with protocol_poll() called while the application is idle
+ */
+
+#define FRAME_LENGTH 9
+#define THROUGHPUT_FRAMES 200000
+#define BURST_FRAMES 20
+#define BURSTS 500
+#define BURST_PERIOD_US 2000
+
+struct sink {
+    int fd;
+    size_t writes;
+    size_t bytes;
+    // Send time of every frame in the latency run
+    uint64_t *send_time;
+    uint64_t *latency;
+    size_t frames_sent;
+    size_t frames_flushed;
+};
+
+static int sink_write(void *ctx, const uint8_t *data, size_t len) {
+    struct sink *sink = ctx;
+    write(sink->fd, data, len);
+    sink->writes++;
+    sink->bytes += len;
+    if (sink->send_time) {
+        uint64_t now = platform_time_us();
+        size_t flushed = sink->bytes / FRAME_LENGTH;
+        for (; sink->frames_flushed < flushed; sink->frames_flushed++) {
+            sink->latency[sink->frames_flushed] =
+                now - sink->send_time[sink->frames_flushed];
+        }
+    }
+    return len;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void bench(const char *name, uint32_t deadline_us, struct sink *sink) {
+    uint8_t payload[] = {'1', 't'};
+
+    // Throughput of back to back frames
+    protocol_set_flush_deadline(deadline_us);
+    sink->writes = 0;
+    sink->bytes = 0;
+    sink->send_time = NULL;
+    uint64_t start = platform_time_us();
+    for (int i = 0; i < THROUGHPUT_FRAMES; i++) {
+        protocol_send(payload, sizeof(payload));
+    }
+    protocol_flush();
+    uint64_t elapsed = platform_time_us() - start;
+    double frames_per_sec = THROUGHPUT_FRAMES * 1e6 / elapsed;
+    double frames_per_write = (double)THROUGHPUT_FRAMES / sink->writes;
+
+    // Latency added to bursts
+    size_t frames = BURSTS * BURST_FRAMES;
+    uint64_t send_time[BURSTS * BURST_FRAMES];
+    uint64_t latency[BURSTS * BURST_FRAMES];
+    sink->writes = 0;
+    sink->bytes = 0;
+    sink->send_time = send_time;
+    sink->latency = latency;
+    sink->frames_sent = 0;
+    sink->frames_flushed = 0;
+    uint64_t next_burst = platform_time_us();
+    for (int b = 0; b < BURSTS; b++) {
+        for (int i = 0; i < BURST_FRAMES; i++) {
+            send_time[sink->frames_sent++] = platform_time_us();
+            protocol_send(payload, sizeof(payload));
+        }
+        // Without a deadline the caller flushes at the end of each burst
+        if (deadline_us == PROTOCOL_NO_DEADLINE) {
+            protocol_flush();
+        }
+        next_burst += BURST_PERIOD_US;
+        while (platform_time_us() < next_burst) {
+            protocol_poll();
+        }
+    }
+    protocol_flush();
+    qsort(latency, frames, sizeof(latency[0]), compare_u64);
+    uint64_t total = 0;
+    for (size_t i = 0; i < frames; i++) {
+        total += latency[i];
+    }
+
+    printf("%-14s %12.0f %10.1f %10.1f %8.1f %8lu %8lu\n", name,
+           frames_per_sec, frames_per_write, (double)frames / sink->writes,
+           (double)total / frames, (unsigned long)latency[frames * 99 / 100],
+           (unsigned long)latency[frames - 1]);
+}
+
+int main() {
+    static struct sink sink;
+    sink.fd = open("/dev/null", O_WRONLY);
+    if (sink.fd < 0) {
+        perror("/dev/null");
+        return 1;
+    }
+    protocol_init();
+    platform_host_set_io(NULL, sink_write, &sink);
+
+    printf("%d byte frames, bursts of %d every %d us, %d byte buffer\n",
+           FRAME_LENGTH, BURST_FRAMES, BURST_PERIOD_US,
+           PROTOCOL_TX_BUFFER_SIZE);
+    printf("%-14s %12s %10s %10s %8s %8s %8s\n", "deadline", "frames/s",
+           "frm/write", "burst f/w", "mean us", "p99 us", "max us");
+    bench("write-through", 0, &sink);
+    bench("50 us", 50, &sink);
+    bench("500 us", 500, &sink);
+    bench("1000 us", 1000, &sink);
+    bench("explicit", PROTOCOL_NO_DEADLINE, &sink);
+    return 0;
+}
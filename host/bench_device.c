@@ -0,0 +1,80 @@
+#include "bench.h"
+#include "platform.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Runs the benchmarks of the 'b' command on the host, for comparison with
+ * the numbers the board sends back to protocol.py. Without arguments it runs
+ * the default set; otherwise each argument names one benchmark as
+ * kind:size[:iterations], with kind one of crc, encode, decode or dispatch:
+ *
+ *     bench_device crc:1024 decode:64:1000
+ *
+ * The stopwatch counts nanoseconds here, where the board counts processor
+ * cycles.
+ */
+
+static const char *kind_names[BENCH_KIND_COUNT] = {"crc", "encode", "decode",
+                                                   "dispatch"};
+
+static int parse_kind(const char *name, size_t length) {
+    for (int kind = 0; kind < BENCH_KIND_COUNT; kind++) {
+        if (strlen(kind_names[kind]) == length &&
+            strncmp(kind_names[kind], name, length) == 0) {
+            return kind;
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    if (argc - 1 > BENCH_MAX) {
+        fprintf(stderr, "at most %d benchmarks\n", BENCH_MAX);
+        return 1;
+    }
+    uint8_t request[BENCH_MAX * BENCH_REQUEST_SIZE];
+    size_t request_length = 0;
+    for (int i = 1; i < argc; i++) {
+        const char *colon = strchr(argv[i], ':');
+        int kind = colon != NULL ? parse_kind(argv[i], colon - argv[i]) : -1;
+        if (kind < 0) {
+            fprintf(stderr, "usage: %s [kind:size[:iterations]]...\n",
+                    argv[0]);
+            return 1;
+        }
+        char *end;
+        unsigned long size = strtoul(colon + 1, &end, 0);
+        unsigned long iterations = *end == ':' ? strtoul(end + 1, NULL, 0) : 0;
+        uint8_t *record = request + request_length;
+        record[0] = kind;
+        record[1] = size;
+        record[2] = size >> 8;
+        record[3] = iterations;
+        record[4] = iterations >> 8;
+        request_length += BENCH_REQUEST_SIZE;
+    }
+
+    struct bench_result results[BENCH_MAX];
+    size_t count = bench_run_set(request, request_length, results);
+    double hz = platform_stopwatch_hz();
+    printf("stopwatch at %.0f MHz\n", hz / 1e6);
+    printf("%-10s %6s %10s %10s %10s %10s %10s %8s\n", "benchmark", "size",
+           "iterations", "min ticks", "max ticks", "mean ticks", "mean us",
+           "wrapped");
+    for (size_t i = 0; i < count; i++) {
+        const struct bench_result *r = &results[i];
+        const char *name =
+            r->kind < BENCH_KIND_COUNT ? kind_names[r->kind] : "?";
+        if (r->iterations == 0) {
+            printf("%-10s %6u %10s\n", name, r->size, "not run");
+            continue;
+        }
+        unsigned timed = r->iterations - r->wrapped;
+        double mean = timed > 0 ? (double)r->total_ticks / timed : 0;
+        printf("%-10s %6u %10u %10u %10u %10.1f %10.3f %8u\n", name, r->size,
+               r->iterations, r->min_ticks, r->max_ticks, mean,
+               mean / hz * 1e6, r->wrapped);
+    }
+    return 0;
+}
@@ -0,0 +1,206 @@
+#include "gateway.h"
+#include "platform.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Measures aggregate throughput and CPU use of the gateway for 1, 16 and 128
+ * simulated devices, with one worker and with a pool of four. A child process
+ * plays the devices, each on one end of a socket pair, and streams 'd' frames
+ * into all of them round robin; it also connects as a client and counts the
+ * records that come out. The parent runs only the gateway, so its CPU time is
+ * the gateway's. The run ends when the devices hang up.
+ */
+
+#define TOTAL_FRAMES 1000000
+#define PAYLOAD_SIZE 32
+#define FRAME_SIZE (PAYLOAD_SIZE + 7)
+// Frames written to one device before moving on to the next
+#define BURST 64
+
+static void write_all(int fd, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n <= 0) {
+            perror("write");
+            exit(1);
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+static void read_all(int fd, uint8_t *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, data, len);
+        if (n <= 0) {
+            fprintf(stderr, "gateway closed the connection\n");
+            exit(1);
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+// Counts the records the gateway sends until it closes the connection
+static void *consume(void *arg) {
+    int fd = *(int *)arg;
+    static uint8_t buffer[65536];
+    static uint64_t records;
+    size_t length = 0;
+    for (;;) {
+        ssize_t n = read(fd, buffer + length, sizeof(buffer) - length);
+        if (n <= 0) {
+            break;
+        }
+        length += n;
+        size_t offset = 0;
+        while (length - offset >= GATEWAY_RECORD_HEADER_SIZE) {
+            size_t record_length = GATEWAY_RECORD_HEADER_SIZE +
+                                   (buffer[offset + 2] << 8 |
+                                    buffer[offset + 3]);
+            if (length - offset < record_length) {
+                break;
+            }
+            records++;
+            offset += record_length;
+        }
+        memmove(buffer, buffer + offset, length - offset);
+        length -= offset;
+    }
+    return &records;
+}
+
+static void run_devices(const char *socket_path, int *devices, int count,
+                        size_t frames_per_device) {
+    int client = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strcpy(addr.sun_path, socket_path);
+    if (client < 0 ||
+        connect(client, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    pthread_t consumer;
+    pthread_create(&consumer, NULL, consume, &client);
+
+    // Wait until the gateway has accepted us, by having it send device 0 a
+    // frame, so no record is broadcast before we listen
+    uint8_t hello[GATEWAY_RECORD_HEADER_SIZE + 2] = {0, 0, 0, 2, 'e', 'g', 'o'};
+    write_all(client, hello, sizeof(hello));
+    uint8_t echo[9];
+    read_all(devices[0], echo, sizeof(echo));
+
+    static uint8_t burst[BURST * FRAME_SIZE];
+    for (int i = 0; i < BURST; i++) {
+        uint8_t payload[PAYLOAD_SIZE];
+        memset(payload, 'a' + i % 26, PAYLOAD_SIZE);
+        protocol_encode_frame(burst + i * FRAME_SIZE, 'd', payload,
+                              PAYLOAD_SIZE);
+    }
+    for (size_t sent = 0; sent < frames_per_device; sent += BURST) {
+        size_t n = frames_per_device - sent < BURST ? frames_per_device - sent
+                                                    : BURST;
+        for (int d = 0; d < count; d++) {
+            write_all(devices[d], burst, n * FRAME_SIZE);
+        }
+    }
+    for (int d = 0; d < count; d++) {
+        close(devices[d]);
+    }
+
+    uint64_t *records;
+    pthread_join(consumer, (void **)&records);
+    uint64_t expected = frames_per_device * count;
+    if (*records != expected) {
+        fprintf(stderr, "client received %llu of %llu frames\n",
+                (unsigned long long)*records, (unsigned long long)expected);
+        exit(1);
+    }
+    exit(0);
+}
+
+static double cpu_seconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void run(int count, int workers) {
+    char socket_path[64];
+    snprintf(socket_path, sizeof(socket_path), "/tmp/bench_gateway.%d.sock",
+             getpid());
+    struct gateway *gw = gateway_create(socket_path, workers);
+    if (gw == NULL) {
+        perror("gateway_create");
+        exit(1);
+    }
+    int devices[count];
+    for (int d = 0; d < count; d++) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+            perror("socketpair");
+            exit(1);
+        }
+        gateway_add_link(gw, fds[0]);
+        devices[d] = fds[1];
+        // The simulated devices do not negotiate; drop the open request
+        uint8_t open[7 + PROTOCOL_CAPS_SIZE];
+        read_all(devices[d], open, sizeof(open));
+    }
+    size_t frames_per_device = TOTAL_FRAMES / count;
+
+    // Keep buffered output from being printed again by the child
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        run_devices(socket_path, devices, count, frames_per_device);
+    }
+    for (int d = 0; d < count; d++) {
+        close(devices[d]);
+    }
+
+    double cpu_start = cpu_seconds();
+    uint64_t start = platform_time_us();
+    gateway_run(gw);
+    uint64_t elapsed = platform_time_us() - start;
+    double cpu = cpu_seconds() - cpu_start;
+
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+    for (int d = 0; d < count; d++) {
+        frames += gateway_link_stats(gw, d)->frames;
+        bytes += gateway_link_stats(gw, d)->bytes;
+    }
+    // Closing the client lets the child finish counting
+    gateway_destroy(gw);
+    int status;
+    waitpid(child, &status, 0);
+
+    printf("%8d %8d %10llu %12.0f %8.1f %8.1f%%%s\n", count, workers,
+           (unsigned long long)frames, frames * 1e6 / elapsed,
+           (double)bytes / elapsed, 100.0 * cpu * 1e6 / elapsed,
+           WIFEXITED(status) && WEXITSTATUS(status) == 0 ? "" : "  LOST");
+}
+
+int main() {
+    signal(SIGPIPE, SIG_IGN);
+    printf("%d frames of %d bytes per run\n", TOTAL_FRAMES, FRAME_SIZE);
+    printf("%8s %8s %10s %12s %8s %9s\n", "devices", "workers", "frames",
+           "frames/s", "MB/s", "CPU");
+    int counts[] = {1, 16, 128};
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        run(counts[i], 1);
+        if (counts[i] > 1) {
+            run(counts[i], 4);
+        }
+    }
+    return 0;
+}
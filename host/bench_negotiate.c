@@ -0,0 +1,169 @@
+#include "platform_host.h"
+#include "protocol.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Compares throughput of fixed frame sizes against the size negotiated in
+ * the open handshake. A child process runs the receive loop of protocol.c
+ * over one end of a socket pair and plays the Pico; the parent plays the PC,
+ * negotiates, then streams the same amount of data in frames of each size.
+ * The frames go to a registered handler that does nothing, since the device
+ * prints every 'd' frame and would measure printf rather than framing. An
+ * echo at the end of each run confirms that everything before it was
+ * handled.
+ */
+
+#define TOTAL_BYTES (4 * 1024 * 1024)
+#define WRITE_CHUNK 65536
+#define TYPE 'w'
+
+static void write_all(int fd, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n <= 0) {
+            perror("write");
+            exit(1);
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+// Reads frames until one of the given type arrives and returns its payload
+// length, copying the payload to out.
+static size_t read_frame(int fd, uint8_t type, uint8_t *out) {
+    static uint8_t buffer[65536 + 7];
+    for (;;) {
+        uint8_t c;
+        do {
+            if (read(fd, &c, 1) != 1) {
+                fprintf(stderr, "device closed the link\n");
+                exit(1);
+            }
+        } while (c != 0xAA);
+        uint8_t header[4];
+        for (size_t got = 0; got < sizeof(header);) {
+            ssize_t n = read(fd, header + got, sizeof(header) - got);
+            if (n <= 0) {
+                exit(1);
+            }
+            got += n;
+        }
+        size_t packet_length = header[0] << 8 | header[1];
+        if (packet_length < 7) {
+            continue;
+        }
+        size_t rest = packet_length - 5;
+        for (size_t got = 0; got < rest;) {
+            ssize_t n = read(fd, buffer + got, rest - got);
+            if (n <= 0) {
+                exit(1);
+            }
+            got += n;
+        }
+        if (header[3] == type) {
+            memcpy(out, buffer, packet_length - 7);
+            return packet_length - 7;
+        }
+    }
+}
+
+static void discard(const uint8_t *payload, size_t payload_length) {}
+
+static void run_device(int fd) {
+    // Keep the device's printf output off the link
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    protocol_init();
+    protocol_register_handler(TYPE, PROTOCOL_ANY_SIZE, discard);
+    platform_host_set_fds(fd, fd);
+    for (;;) {
+        protocol_receive();
+    }
+}
+
+static size_t negotiate(int fd) {
+    uint8_t caps[PROTOCOL_CAPS_SIZE] = {
+        0, 2, 2, 0xFF, 0xFF, 1, PROTOCOL_CHECKSUM_CRC8,
+        PROTOCOL_COMPRESSION_NONE, PROTOCOL_FRAMING_MARKERS};
+    uint8_t packet[7 + PROTOCOL_CAPS_SIZE];
+    size_t length = protocol_encode_frame(packet, 'o', caps, sizeof(caps));
+    write_all(fd, packet, length);
+    uint8_t reply[65536];
+    length = read_frame(fd, 'o', reply);
+    if (length < PROTOCOL_CAPS_SIZE) {
+        fprintf(stderr, "device did not send capabilities\n");
+        exit(1);
+    }
+    printf("device: versions %d-%d, max frame %d, %d receive buffer(s)\n",
+           reply[1], reply[2], reply[3] << 8 | reply[4], reply[5]);
+    size_t frame_size = reply[3] << 8 | reply[4];
+    return frame_size < 0xFFFF ? frame_size : 0xFFFF;
+}
+
+static void stream(int fd, const char *name, size_t frame_size) {
+    static uint8_t out[WRITE_CHUNK + 65536];
+    static uint8_t payload[65536];
+    memset(payload, 'x', sizeof(payload));
+    size_t chunk = frame_size - 7;
+    size_t frames = 0;
+
+    uint64_t start = platform_time_us();
+    size_t sent = 0;
+    size_t buffered = 0;
+    while (sent < TOTAL_BYTES) {
+        size_t n = TOTAL_BYTES - sent < chunk ? TOTAL_BYTES - sent : chunk;
+        buffered += protocol_encode_frame(out + buffered, TYPE, payload, n);
+        sent += n;
+        frames++;
+        if (buffered >= WRITE_CHUNK) {
+            write_all(fd, out, buffered);
+            buffered = 0;
+        }
+    }
+    // The echo comes back once every frame before it has been handled
+    uint8_t marker[] = "done";
+    buffered +=
+        protocol_encode_frame(out + buffered, 'e', marker, sizeof(marker));
+    write_all(fd, out, buffered);
+    uint8_t reply[65536];
+    read_frame(fd, 'd', reply);
+    uint64_t elapsed = platform_time_us() - start;
+
+    printf("%-12s %10zu %10zu %12.2f %10.1f%%\n", name, frame_size, frames,
+           TOTAL_BYTES / (double)elapsed,
+           100.0 * 7 * frames / (TOTAL_BYTES + 7 * frames));
+}
+
+int main() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+    pid_t device = fork();
+    if (device == 0) {
+        close(fds[0]);
+        run_device(fds[1]);
+    }
+    close(fds[1]);
+
+    size_t negotiated = negotiate(fds[0]);
+    printf("%d bytes of payload per run\n", TOTAL_BYTES);
+    printf("%-12s %10s %10s %12s %11s\n", "run", "frame size", "frames",
+           "MB/s", "overhead");
+    stream(fds[0], "fixed", 16);
+    stream(fds[0], "fixed", 64);
+    stream(fds[0], "fixed", 256);
+    stream(fds[0], "negotiated", negotiated);
+
+    kill(device, SIGTERM);
+    waitpid(device, NULL, 0);
+    return 0;
+}
@@ -0,0 +1,167 @@
+#include "pipeline.h"
+#include "platform.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Shows how much of an incoming stream the device keeps up with while
+ * handlers take variable time, with and without the pipeline. A simulated
+ * USB link offers frames at a fixed rate into a small receive FIFO. When the
+ * FIFO is full the sender has to wait, as USB flow control makes it, and
+ * that part of the offered rate is lost. Most handlers return at once; one
+ * in SLOW_EVERY takes SLOW_US.
+ *
+ * The serial run reads, parses and dispatches on one thread, as
+ * protocol_receive does. The pipelined run has a receiver thread and a
+ * dispatcher thread sharing a pipeline, as the two cores of the RP2040 do.
+ * Slow handlers busy-wait when there are two or more CPUs, and sleep
+ * otherwise so that the receiver thread still gets to run.
+ */
+
+#define FRAMES 50000
+#define PAYLOAD_SIZE 32
+#define FRAME_SIZE (PAYLOAD_SIZE + 7)
+#define TYPE 'w'
+// Offered rate, 1 MB/s, about what USB full speed CDC sustains
+#define RATE_BYTES_PER_US 1
+// Receive buffer of the USB CDC driver
+#define FIFO_SIZE 256
+#define SLOW_EVERY 20
+#define SLOW_US 300
+// Largest read from the link
+#define READ_SIZE 64
+
+struct usb_link {
+    uint8_t *data;
+    size_t length;
+    // Bytes the sender has put in the FIFO, and bytes read from it
+    size_t sent;
+    size_t read;
+    uint64_t last_us;
+};
+
+static struct usb_link usb;
+static struct protocol_conn conn;
+static struct pipeline pipeline;
+static atomic_int handled;
+static bool busy_wait;
+
+static size_t usb_read(uint8_t *out, size_t max) {
+    uint64_t now = platform_time_us();
+    // The sender offers bytes at the link rate, but can only put them in
+    // free FIFO space; what does not fit is rate lost for good
+    size_t offered = (now - usb.last_us) * RATE_BYTES_PER_US;
+    size_t space = FIFO_SIZE - (usb.sent - usb.read);
+    size_t left = usb.length - usb.sent;
+    size_t pushed = offered < space ? offered : space;
+    usb.sent += pushed < left ? pushed : left;
+    usb.last_us = now;
+
+    size_t n = usb.sent - usb.read;
+    if (n > max) {
+        n = max;
+    }
+    memcpy(out, usb.data + usb.read, n);
+    usb.read += n;
+    return n;
+}
+
+static void handle(const uint8_t *payload, size_t payload_length) {
+    uint32_t sequence;
+    memcpy(&sequence, payload, sizeof(sequence));
+    if (sequence % SLOW_EVERY == 0) {
+        if (busy_wait) {
+            uint64_t until = platform_time_us() + SLOW_US;
+            while (platform_time_us() < until) {
+            }
+        } else {
+            struct timespec delay = {0, SLOW_US * 1000};
+            nanosleep(&delay, NULL);
+        }
+    }
+    atomic_fetch_add(&handled, 1);
+}
+
+static int discard(void *io, const uint8_t *data, size_t len) { return len; }
+
+static void reset() {
+    usb.sent = 0;
+    usb.read = 0;
+    usb.last_us = platform_time_us();
+    atomic_store(&handled, 0);
+    protocol_conn_init(&conn, discard, NULL);
+    pipeline_init(&pipeline, &conn);
+}
+
+static void run_serial() {
+    while (atomic_load(&handled) < FRAMES) {
+        uint8_t burst[READ_SIZE];
+        size_t n = usb_read(burst, sizeof(burst));
+        protocol_conn_receive_bytes(&conn, burst, n);
+    }
+}
+
+static void *receiver(void *arg) {
+    while (usb.read < usb.length || pipeline.pending.length > 0) {
+        uint8_t burst[READ_SIZE];
+        size_t n = usb_read(burst, sizeof(burst));
+        if (n == 0) {
+            sched_yield();
+        }
+        for (size_t offset = 0; offset < n;) {
+            offset += pipeline_receive(&pipeline, burst + offset, n - offset);
+        }
+        pipeline_receive(&pipeline, NULL, 0);
+    }
+    return NULL;
+}
+
+static void run_pipelined() {
+    pthread_t thread;
+    pthread_create(&thread, NULL, receiver, NULL);
+    while (atomic_load(&handled) < FRAMES) {
+        if (!pipeline_dispatch(&pipeline)) {
+            sched_yield();
+        }
+    }
+    pthread_join(thread, NULL);
+}
+
+static void report(const char *name, void (*run)()) {
+    reset();
+    uint64_t start = platform_time_us();
+    run();
+    uint64_t elapsed = platform_time_us() - start;
+    double offered_us = (double)usb.length / RATE_BYTES_PER_US;
+    printf("%-10s %10.3f %12.0f %9.1f%% %8u\n", name, elapsed / 1e6,
+           usb.length * 1e6 / 1024 / elapsed, 100.0 * offered_us / elapsed,
+           pipeline.stalls);
+}
+
+int main() {
+    usb.length = FRAMES * FRAME_SIZE;
+    usb.data = malloc(usb.length);
+    for (uint32_t i = 0; i < FRAMES; i++) {
+        uint8_t payload[PAYLOAD_SIZE] = {0};
+        memcpy(payload, &i, sizeof(i));
+        protocol_encode_frame(usb.data + i * FRAME_SIZE, TYPE, payload,
+                              PAYLOAD_SIZE);
+    }
+    protocol_register_handler(TYPE, PAYLOAD_SIZE, handle);
+    busy_wait = sysconf(_SC_NPROCESSORS_ONLN) >= 2;
+
+    printf("%d frames of %d bytes offered at %d MB/s into a %d byte FIFO\n",
+           FRAMES, FRAME_SIZE, RATE_BYTES_PER_US, FIFO_SIZE);
+    printf("1 in %d handlers takes %d us (%s), %d byte ring\n", SLOW_EVERY,
+           SLOW_US, busy_wait ? "busy" : "sleeping", PIPELINE_RING_SIZE);
+    printf("%-10s %10s %12s %10s %8s\n", "run", "seconds", "KiB/s",
+           "of offered", "stalls");
+    report("serial", run_serial);
+    report("pipelined", run_pipelined);
+    free(usb.data);
+    return 0;
+}
@@ -0,0 +1,142 @@
+#include "protocol.h"
+#include "platform.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Measures how fast the parser gets through streams where 0 to 90% of the
+ * bytes are junk between frames. Junk is random, so it holds a stray start
+ * marker every 256 bytes or so. Each stream is fed to protocol_conn_parse a
+ * byte at a time, as a slow USB link does, and in chunks of CHUNK_SIZE, as
+ * the pipeline, the gateway and replay do. A stray marker
+ * the parser takes for a frame can swallow the real frames after it, so the
+ * share of frames recovered is reported too. A second table compares ways
+ * of scanning a buffer without any marker in it.
+ */
+
+#define STREAM_SIZE (8 << 20)
+#define PAYLOAD_SIZE 32
+#define FRAME_SIZE (PAYLOAD_SIZE + 7)
+#define CHUNK_SIZE 4096
+#define SCAN_ROUNDS 20
+
+static uint8_t *stream;
+static size_t stream_length;
+static uint32_t frames_in_stream;
+
+static int discard(void *io, const uint8_t *data, size_t len) { return len; }
+
+static void build_stream(int junk_percent) {
+    stream_length = 0;
+    frames_in_stream = 0;
+    // Average junk run that makes up junk_percent of the stream
+    size_t average = FRAME_SIZE * junk_percent / (100 - junk_percent);
+    for (;;) {
+        size_t junk = average > 0 ? rand() % (2 * average + 1) : 0;
+        if (stream_length + junk + FRAME_SIZE > STREAM_SIZE) {
+            break;
+        }
+        for (size_t i = 0; i < junk; i++) {
+            stream[stream_length++] = rand();
+        }
+        uint8_t *packet = stream + stream_length;
+        // Fill the payload in place; the encoder moves it as needed
+        for (size_t i = 0; i < PAYLOAD_SIZE; i++) {
+            packet[5 + i] = rand();
+        }
+        stream_length += protocol_encode_frame(packet, 'd', packet + 5,
+                                               PAYLOAD_SIZE);
+        frames_in_stream++;
+    }
+}
+
+// Parses the stream in chunks of at most chunk_size bytes and returns the
+// number of intact frames found
+static uint32_t parse_stream(size_t chunk_size, double *mb_per_s) {
+    static struct protocol_conn conn;
+    protocol_conn_init(&conn, discard, NULL);
+    uint32_t frames = 0;
+    uint64_t start = platform_time_us();
+    for (size_t offset = 0; offset < stream_length;) {
+        size_t chunk = stream_length - offset < chunk_size
+                           ? stream_length - offset
+                           : chunk_size;
+        size_t end = offset + chunk;
+        while (offset < end) {
+            struct protocol_frame frame;
+            offset += protocol_conn_parse(&conn, stream + offset, end - offset,
+                                          &frame);
+            frames += frame.length > 0 && frame.error == NO_ERROR;
+        }
+    }
+    uint64_t elapsed = platform_time_us() - start;
+    *mb_per_s = (double)stream_length / elapsed;
+    return frames;
+}
+
+static size_t scan_bytes(const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] == 0xAA) {
+            return i;
+        }
+    }
+    return len;
+}
+
+static size_t scan_memchr(const uint8_t *data, size_t len) {
+    const uint8_t *found = memchr(data, 0xAA, len);
+    return found != NULL ? (size_t)(found - data) : len;
+}
+
+static void report_scan(const char *name,
+                        size_t (*scan)(const uint8_t *, size_t)) {
+    size_t total = 0;
+    uint64_t start = platform_time_us();
+    for (int round = 0; round < SCAN_ROUNDS; round++) {
+        // Scan in chunks, as the parser does, and keep the result so the
+        // scan is not optimized away
+        for (size_t offset = 0; offset < STREAM_SIZE; offset += CHUNK_SIZE) {
+            total += scan(stream + offset, CHUNK_SIZE);
+        }
+    }
+    uint64_t elapsed = platform_time_us() - start;
+    printf("%-20s %10.0f%s\n", name,
+           (double)STREAM_SIZE * SCAN_ROUNDS / elapsed,
+           total == (size_t)STREAM_SIZE * SCAN_ROUNDS ? "" : "  WRONG");
+}
+
+int main() {
+    stream = malloc(STREAM_SIZE);
+    srand(1);
+
+    printf("%d MiB streams of %d byte frames, chunks of %d bytes\n",
+           STREAM_SIZE >> 20, FRAME_SIZE, CHUNK_SIZE);
+    printf("%6s %10s %21s %21s\n", "junk", "frames", "byte at a time",
+           "chunked");
+    printf("%6s %10s %10s %10s %10s %10s\n", "", "", "MB/s", "recovered",
+           "MB/s", "recovered");
+    int junk_percents[] = {0, 10, 50, 90};
+    for (size_t i = 0; i < sizeof(junk_percents) / sizeof(junk_percents[0]);
+         i++) {
+        build_stream(junk_percents[i]);
+        double byte_rate;
+        double chunk_rate;
+        uint32_t byte_frames = parse_stream(1, &byte_rate);
+        uint32_t chunk_frames = parse_stream(CHUNK_SIZE, &chunk_rate);
+        printf("%5d%% %10u %10.1f %9.2f%% %10.1f %9.2f%%\n",
+               junk_percents[i], frames_in_stream, byte_rate,
+               100.0 * byte_frames / frames_in_stream, chunk_rate,
+               100.0 * chunk_frames / frames_in_stream);
+    }
+
+    // Junk without any start marker, so every scan runs to the end
+    for (size_t i = 0; i < STREAM_SIZE; i++) {
+        stream[i] = rand() % 0xAA;
+    }
+    printf("\n%-20s %10s\n", "scan", "MB/s");
+    report_scan("byte loop", scan_bytes);
+    report_scan("memchr", scan_memchr);
+    report_scan("protocol_find_start", protocol_find_start);
+    free(stream);
+    return 0;
+}
@@ -0,0 +1,137 @@
+#include "platform_host.h"
+#include "protocol.h"
+#include "telemetry.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Compares the generated telemetry accessors against hand-written packing.
+ * Messages are laid out back to back, so most of them sit at unaligned
+ * offsets as they would in a receive buffer.
+ *
+ *  - generated: telemetry_get_* / telemetry_set_* from schemas/telemetry.schema
+ *  - offsets:   memcpy of each field at a hand-written offset
+ *  - struct:    memcpy of the whole payload into a packed struct
+ */
+
+#define MESSAGES 4096
+#define ROUNDS 2000
+
+struct __attribute__((packed)) telemetry_struct {
+    uint32_t timestamp_us;
+    int16_t temperature;
+    uint16_t voltage_mv;
+    float current;
+    uint8_t flags;
+    uint8_t label[8];
+};
+
+static uint8_t buffer[MESSAGES * TELEMETRY_SIZE];
+static volatile uint32_t sink;
+
+static double rate(uint64_t start) {
+    uint64_t elapsed = platform_time_us() - start;
+    return (double)MESSAGES * ROUNDS / elapsed;
+}
+
+static void decode_generated() {
+    uint32_t sum = 0;
+    for (int i = 0; i < MESSAGES; i++) {
+        const uint8_t *p = buffer + i * TELEMETRY_SIZE;
+        sum += telemetry_get_timestamp_us(p) + telemetry_get_temperature(p) +
+               telemetry_get_voltage_mv(p) + (uint32_t)telemetry_get_current(p) +
+               telemetry_get_flags(p) + telemetry_get_label(p, 0);
+    }
+    sink = sum;
+}
+
+static void decode_offsets() {
+    uint32_t sum = 0;
+    for (int i = 0; i < MESSAGES; i++) {
+        const uint8_t *p = buffer + i * TELEMETRY_SIZE;
+        uint32_t timestamp_us;
+        int16_t temperature;
+        uint16_t voltage_mv;
+        float current;
+        memcpy(&timestamp_us, p, 4);
+        memcpy(&temperature, p + 4, 2);
+        memcpy(&voltage_mv, p + 6, 2);
+        memcpy(&current, p + 8, 4);
+        sum += timestamp_us + temperature + voltage_mv + (uint32_t)current +
+               p[12] + p[13];
+    }
+    sink = sum;
+}
+
+static void decode_struct() {
+    uint32_t sum = 0;
+    for (int i = 0; i < MESSAGES; i++) {
+        struct telemetry_struct t;
+        memcpy(&t, buffer + i * TELEMETRY_SIZE, sizeof(t));
+        sum += t.timestamp_us + t.temperature + t.voltage_mv +
+               (uint32_t)t.current + t.flags + t.label[0];
+    }
+    sink = sum;
+}
+
+static void encode_generated() {
+    for (int i = 0; i < MESSAGES; i++) {
+        uint8_t *p = buffer + i * TELEMETRY_SIZE;
+        telemetry_set_timestamp_us(p, i);
+        telemetry_set_temperature(p, -i);
+        telemetry_set_voltage_mv(p, 3300);
+        telemetry_set_current(p, 0.5f);
+        telemetry_set_flags(p, i);
+        for (size_t j = 0; j < TELEMETRY_LABEL_COUNT; j++) {
+            telemetry_set_label(p, j, 'a');
+        }
+    }
+}
+
+static void encode_offsets() {
+    for (int i = 0; i < MESSAGES; i++) {
+        uint8_t *p = buffer + i * TELEMETRY_SIZE;
+        uint32_t timestamp_us = i;
+        int16_t temperature = -i;
+        uint16_t voltage_mv = 3300;
+        float current = 0.5f;
+        memcpy(p, &timestamp_us, 4);
+        memcpy(p + 4, &temperature, 2);
+        memcpy(p + 6, &voltage_mv, 2);
+        memcpy(p + 8, &current, 4);
+        p[12] = i;
+        memset(p + 13, 'a', 8);
+    }
+}
+
+static void encode_struct() {
+    for (int i = 0; i < MESSAGES; i++) {
+        struct telemetry_struct t = {i, -i, 3300, 0.5f, i, {0}};
+        memset(t.label, 'a', sizeof(t.label));
+        memcpy(buffer + i * TELEMETRY_SIZE, &t, sizeof(t));
+    }
+}
+
+static void bench(const char *name, void (*encode)(), void (*decode)()) {
+    uint64_t start = platform_time_us();
+    for (int r = 0; r < ROUNDS; r++) {
+        encode();
+    }
+    double encode_rate = rate(start);
+    start = platform_time_us();
+    for (int r = 0; r < ROUNDS; r++) {
+        decode();
+    }
+    double decode_rate = rate(start);
+    printf("%-10s %14.1f %14.1f\n", name, encode_rate, decode_rate);
+}
+
+int main() {
+    printf("%d byte telemetry messages, millions of messages per second\n",
+           TELEMETRY_SIZE);
+    printf("%-10s %14s %14s\n", "method", "encode", "decode");
+    bench("generated", encode_generated, decode_generated);
+    bench("offsets", encode_offsets, decode_offsets);
+    bench("struct", encode_struct, decode_struct);
+    return 0;
+}
@@ -0,0 +1,25 @@
+#include "capture.h"
+#include "schema.h"
+#include <string.h>
+
+int capture_write_header(FILE *file) {
+    uint8_t header[CAPTURE_HEADER_SIZE];
+    memcpy(header, CAPTURE_MAGIC, 7);
+    header[7] = CAPTURE_VERSION;
+    return fwrite(header, sizeof(header), 1, file) == 1 ? 0 : -1;
+}
+
+int capture_write_record(FILE *file, uint64_t timestamp_us, uint8_t direction,
+                         const uint8_t *data, uint32_t length) {
+    uint8_t header[CAPTURE_RECORD_SIZE] = {0};
+    schema_store_u64(header, timestamp_us);
+    schema_store_u32(header + 8, length);
+    header[12] = direction;
+    if (fwrite(header, sizeof(header), 1, file) != 1) {
+        return -1;
+    }
+    if (length > 0 && fwrite(data, length, 1, file) != 1) {
+        return -1;
+    }
+    return 0;
+}
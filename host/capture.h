@@ -0,0 +1,36 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Capture file format, written by tap and protocol.py and read by replay.
+ *
+ * The file starts with the 8 byte magic "PICOCAP" followed by a version
+ * byte, then holds one record per chunk of bytes seen on the link. Each
+ * record is a 16 byte header followed by the raw bytes:
+ *
+ *   timestamp_us  8 bytes  time since the capture started
+ *   length        4 bytes  number of bytes that follow
+ *   direction     1 byte   CAPTURE_FROM_DEVICE or CAPTURE_TO_DEVICE
+ *   reserved      3 bytes  zero
+ *
+ * All numbers are little-endian.
+ */
+
+#define CAPTURE_MAGIC "PICOCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_SIZE 8
+#define CAPTURE_RECORD_SIZE 16
+
+#define CAPTURE_FROM_DEVICE 0
+#define CAPTURE_TO_DEVICE 1
+
+// Writes the file header. Returns 0 on success.
+int capture_write_header(FILE *file);
+// Appends one record. Returns 0 on success.
+int capture_write_record(FILE *file, uint64_t timestamp_us, uint8_t direction,
+                         const uint8_t *data, uint32_t length);
+
+#endif
@@ -0,0 +1,677 @@
+#define _GNU_SOURCE
+#include "gateway.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 64
+// Bytes read from a link per wakeup, so one busy link cannot starve the rest
+#define READ_SIZE 4096
+// Records waiting to be sent to the clients by one worker
+#define OUTPUT_SIZE 65536
+// Largest record a client can send, header included
+#define CLIENT_INPUT_SIZE (GATEWAY_RECORD_HEADER_SIZE + 65535)
+
+// What a file descriptor in an epoll set is
+enum source_kind {
+    SOURCE_LINK,
+    SOURCE_CLIENT,
+    SOURCE_LISTEN,
+    SOURCE_STOP,
+};
+
+// Start of every structure registered with epoll
+struct source {
+    enum source_kind kind;
+    int fd;
+};
+
+struct link {
+    struct source source;
+    int index;
+    atomic_bool open;
+    // Largest frame the device takes, set from its open reply by the owning
+    // worker and read by worker 0
+    atomic_size_t frame_size;
+    // Receive side is only used by the owning worker, send side by worker 0
+    struct protocol_conn conn;
+    // epoll instance of the owning worker
+    int epoll_fd;
+    // Frames the device had no room for yet, GATEWAY_LINK_QUEUE_SIZE bytes.
+    // Queued by worker 0 and sent on by the owning worker under output_lock.
+    pthread_mutex_t output_lock;
+    uint8_t *output;
+    size_t output_length;
+    // Whether the owning worker waits for the link to become writable
+    bool want_write;
+    // Frames dropped because the queue was full
+    atomic_uint frames_dropped;
+};
+
+struct client {
+    struct source source;
+    // Cleared under clients_lock when a send fails or the client falls
+    // behind; worker 0 removes the client on hangup
+    atomic_bool open;
+    // Bytes of records that have not been handled yet
+    uint8_t input[CLIENT_INPUT_SIZE];
+    size_t input_length;
+    // Records the socket had no room for yet, GATEWAY_CLIENT_QUEUE_SIZE
+    // bytes. Written by every worker under clients_lock.
+    uint8_t *output;
+    size_t output_length;
+    // Whether worker 0 waits for the socket to become writable
+    bool want_write;
+};
+
+struct worker {
+    struct gateway *gw;
+    int epoll_fd;
+    pthread_t thread;
+    // Records from this worker's links, sent to the clients after each wakeup
+    uint8_t output[OUTPUT_SIZE];
+    size_t output_length;
+};
+
+struct gateway {
+    char socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    struct source listen;
+    // Read end of a pipe that becomes readable when the gateway should stop
+    struct source stop;
+    int stop_write;
+    struct link **links;
+    int link_count;
+    atomic_int open_links;
+    // Clients are added and removed by worker 0 and sent to by all workers
+    struct client **clients;
+    int client_count;
+    pthread_mutex_t clients_lock;
+    struct worker *workers;
+    int worker_count;
+    bool running;
+};
+
+static int epoll_add(int epoll_fd, struct source *source) {
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = source};
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, source->fd, &event);
+}
+
+// Writes as much as a link takes without blocking. Returns the number of
+// bytes written, or -1 if the link failed.
+static ssize_t write_some(int fd, const uint8_t *data, size_t len) {
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(fd, data + written, len - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                break;
+            }
+            return -1;
+        }
+        written += n;
+    }
+    return written;
+}
+
+// Counts the frames in bytes written by a protocol_conn, which only ever
+// writes whole frames
+static unsigned count_frames(const uint8_t *data, size_t len) {
+    unsigned frames = 0;
+    for (size_t i = 0; i + 3 <= len; frames++) {
+        size_t length = data[i + 1] << 8 | data[i + 2];
+        if (length == 0) {
+            break;
+        }
+        i += length;
+    }
+    return frames;
+}
+
+// Asks the owning worker to report when a link becomes writable, as long as
+// frames wait in its queue. Called with output_lock held.
+static void watch_link_writable(struct link *link) {
+    bool want_write = link->output_length > 0;
+    if (want_write == link->want_write) {
+        return;
+    }
+    struct epoll_event event = {.events = EPOLLIN | (want_write ? EPOLLOUT : 0),
+                                .data.ptr = link};
+    epoll_ctl(link->epoll_fd, EPOLL_CTL_MOD, link->source.fd, &event);
+    link->want_write = want_write;
+}
+
+// Write function of a link's protocol_conn. Writes what the device takes
+// and queues the rest. Frames the queue has no room for are dropped whole
+// and counted, so the device never sees part of a frame and a stalled
+// device cannot hold up the worker.
+static int link_write(void *io, const uint8_t *data, size_t len) {
+    struct link *link = io;
+    pthread_mutex_lock(&link->output_lock);
+    if (link->output_length + len > GATEWAY_LINK_QUEUE_SIZE) {
+        atomic_fetch_add(&link->frames_dropped, count_frames(data, len));
+        pthread_mutex_unlock(&link->output_lock);
+        return 0;
+    }
+    size_t written = 0;
+    // Frames go straight out only behind everything queued before them
+    if (link->output_length == 0) {
+        ssize_t n = write_some(link->source.fd, data, len);
+        // A failed link is closed by its reader; the frames go nowhere
+        written = n < 0 ? len : (size_t)n;
+    }
+    memcpy(link->output + link->output_length, data + written, len - written);
+    link->output_length += len - written;
+    watch_link_writable(link);
+    pthread_mutex_unlock(&link->output_lock);
+    return len;
+}
+
+// Sends the frames queued for a link once it has room again
+static void write_link(struct link *link) {
+    pthread_mutex_lock(&link->output_lock);
+    ssize_t n = write_some(link->source.fd, link->output, link->output_length);
+    if (n < 0) {
+        n = link->output_length;
+    }
+    memmove(link->output, link->output + n, link->output_length - n);
+    link->output_length -= n;
+    watch_link_writable(link);
+    pthread_mutex_unlock(&link->output_lock);
+}
+
+// Sends as much as the socket takes without blocking. Returns the number of
+// bytes sent, or -1 if the client is gone.
+static ssize_t send_some(int fd, const uint8_t *data, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n =
+            send(fd, data + sent, len - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                break;
+            }
+            return -1;
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+// Drops a client that failed or fell behind. Shutting the socket down makes
+// it readable, and worker 0 then removes it as on any hangup.
+static void drop_client(struct client *client) {
+    atomic_store(&client->open, false);
+    client->output_length = 0;
+    shutdown(client->source.fd, SHUT_RDWR);
+}
+
+// Asks worker 0 to report when a client's socket becomes writable, as long
+// as records wait in its queue. Called with clients_lock held.
+static void watch_writable(struct gateway *gw, struct client *client) {
+    bool want_write =
+        atomic_load(&client->open) && client->output_length > 0;
+    if (want_write == client->want_write) {
+        return;
+    }
+    struct epoll_event event = {.events = EPOLLIN | (want_write ? EPOLLOUT : 0),
+                                .data.ptr = client};
+    epoll_ctl(gw->workers[0].epoll_fd, EPOLL_CTL_MOD, client->source.fd,
+              &event);
+    client->want_write = want_write;
+}
+
+// Sends queued records, then as much of data as the socket takes, and
+// queues the rest. Called with clients_lock held.
+static void send_client(struct gateway *gw, struct client *client,
+                        const uint8_t *data, size_t len) {
+    if (!atomic_load(&client->open)) {
+        return;
+    }
+    if (client->output_length > 0) {
+        ssize_t n =
+            send_some(client->source.fd, client->output, client->output_length);
+        if (n < 0) {
+            drop_client(client);
+            return;
+        }
+        memmove(client->output, client->output + n, client->output_length - n);
+        client->output_length -= n;
+    }
+    // Records go straight out only behind everything queued before them
+    if (client->output_length == 0 && len > 0) {
+        ssize_t n = send_some(client->source.fd, data, len);
+        if (n < 0) {
+            drop_client(client);
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+    if (client->output_length + len > GATEWAY_CLIENT_QUEUE_SIZE) {
+        drop_client(client);
+        return;
+    }
+    memcpy(client->output + client->output_length, data, len);
+    client->output_length += len;
+}
+
+// Sends the records collected by a worker to every client
+static void broadcast(struct worker *w) {
+    struct gateway *gw = w->gw;
+    if (w->output_length == 0) {
+        return;
+    }
+    // One worker's batch is queued in one piece, so records never interleave
+    pthread_mutex_lock(&gw->clients_lock);
+    for (int i = 0; i < gw->client_count; i++) {
+        send_client(gw, gw->clients[i], w->output, w->output_length);
+        watch_writable(gw, gw->clients[i]);
+    }
+    pthread_mutex_unlock(&gw->clients_lock);
+    w->output_length = 0;
+}
+
+// Sends the records queued for a client once its socket has room again
+static void write_client(struct worker *w, struct client *client) {
+    struct gateway *gw = w->gw;
+    pthread_mutex_lock(&gw->clients_lock);
+    send_client(gw, client, NULL, 0);
+    watch_writable(gw, client);
+    pthread_mutex_unlock(&gw->clients_lock);
+}
+
+static void append_record(struct worker *w, int index, uint8_t type,
+                          const uint8_t *payload, size_t payload_length) {
+    if (w->output_length + GATEWAY_RECORD_HEADER_SIZE + payload_length >
+        OUTPUT_SIZE) {
+        broadcast(w);
+    }
+    uint8_t *record = w->output + w->output_length;
+    record[0] = index >> 8;
+    record[1] = index;
+    record[2] = payload_length >> 8;
+    record[3] = payload_length;
+    record[4] = type;
+    memcpy(record + GATEWAY_RECORD_HEADER_SIZE, payload, payload_length);
+    w->output_length += GATEWAY_RECORD_HEADER_SIZE + payload_length;
+}
+
+static void close_link(struct worker *w, struct link *link) {
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, link->source.fd, NULL);
+    atomic_store(&link->open, false);
+    // Nothing is left to serve once the last link hangs up
+    if (atomic_fetch_sub(&w->gw->open_links, 1) == 1) {
+        gateway_stop(w->gw);
+    }
+}
+
+static void read_link(struct worker *w, struct link *link) {
+    uint8_t buffer[READ_SIZE];
+    ssize_t n = read(link->source.fd, buffer, sizeof(buffer));
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    // A closed pty or serial port reads as EIO rather than end of file
+    if (n <= 0) {
+        close_link(w, link);
+        return;
+    }
+
+    const uint8_t *data = buffer;
+    size_t len = n;
+    while (len > 0) {
+        struct protocol_frame frame;
+        size_t used = protocol_conn_parse(&link->conn, data, len, &frame);
+        data += used;
+        len -= used;
+        if (frame.length > 0 && frame.error == NO_ERROR) {
+            // The device's reply to our open sets the frame size. It is
+            // decoded here rather than dispatched, so the send side stays
+            // with worker 0 and the gateway has no device side effects.
+            struct protocol_caps caps;
+            if (frame.packet[4] == 'o' &&
+                protocol_decode_caps(frame.packet + 5, frame.length - 7,
+                                     &caps) &&
+                caps.flags & PROTOCOL_CAPS_REPLY) {
+                link->conn.peer_caps = caps;
+                atomic_store(&link->frame_size,
+                             protocol_conn_frame_size(&link->conn));
+            }
+            append_record(w, link->index, frame.packet[4], frame.packet + 5,
+                          frame.length - 7);
+        }
+    }
+}
+
+static void accept_client(struct worker *w) {
+    struct gateway *gw = w->gw;
+    int fd = accept4(gw->listen.fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0) {
+        return;
+    }
+    struct client *client = calloc(1, sizeof(*client));
+    uint8_t *output = malloc(GATEWAY_CLIENT_QUEUE_SIZE);
+    if (client == NULL || output == NULL) {
+        free(client);
+        free(output);
+        close(fd);
+        return;
+    }
+    client->output = output;
+    client->source.kind = SOURCE_CLIENT;
+    client->source.fd = fd;
+    atomic_init(&client->open, true);
+
+    // The other workers walk the array while they broadcast, so it may only
+    // move under the lock
+    pthread_mutex_lock(&gw->clients_lock);
+    struct client **clients =
+        realloc(gw->clients, (gw->client_count + 1) * sizeof(*clients));
+    if (clients == NULL) {
+        pthread_mutex_unlock(&gw->clients_lock);
+        free(client);
+        free(output);
+        close(fd);
+        return;
+    }
+    gw->clients = clients;
+    gw->clients[gw->client_count++] = client;
+    pthread_mutex_unlock(&gw->clients_lock);
+    epoll_add(w->epoll_fd, &client->source);
+}
+
+static void remove_client(struct worker *w, struct client *client) {
+    struct gateway *gw = w->gw;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, client->source.fd, NULL);
+    pthread_mutex_lock(&gw->clients_lock);
+    for (int i = 0; i < gw->client_count; i++) {
+        if (gw->clients[i] == client) {
+            gw->clients[i] = gw->clients[--gw->client_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&gw->clients_lock);
+    close(client->source.fd);
+    free(client->output);
+    free(client);
+}
+
+// Answers a record that does not fit the link's frame size with the LENGTH
+// acknowledgement the device would send
+static void refuse_record(struct gateway *gw, struct client *client,
+                          int index) {
+    uint8_t record[GATEWAY_RECORD_HEADER_SIZE + 1] = {index >> 8, index, 0, 1,
+                                                      'a', LENGTH};
+    pthread_mutex_lock(&gw->clients_lock);
+    send_client(gw, client, record, sizeof(record));
+    watch_writable(gw, client);
+    pthread_mutex_unlock(&gw->clients_lock);
+}
+
+// Frames the records a client sent and writes them to their links
+static void read_client(struct worker *w, struct client *client) {
+    struct gateway *gw = w->gw;
+    ssize_t n = recv(client->source.fd, client->input + client->input_length,
+                     CLIENT_INPUT_SIZE - client->input_length, MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (n <= 0 || !atomic_load(&client->open)) {
+        remove_client(w, client);
+        return;
+    }
+    client->input_length += n;
+
+    size_t offset = 0;
+    while (client->input_length - offset >= GATEWAY_RECORD_HEADER_SIZE) {
+        const uint8_t *record = client->input + offset;
+        size_t payload_length = record[2] << 8 | record[3];
+        size_t record_length = GATEWAY_RECORD_HEADER_SIZE + payload_length;
+        if (client->input_length - offset < record_length) {
+            break;
+        }
+        int index = record[0] << 8 | record[1];
+        struct link *link = index < gw->link_count ? gw->links[index] : NULL;
+        if (link == NULL || !atomic_load(&link->open)) {
+            // Nowhere to send it
+        } else if (payload_length + 7 > atomic_load(&link->frame_size)) {
+            refuse_record(gw, client, index);
+        } else {
+            protocol_conn_send_typed(&link->conn, record[4],
+                                     record + GATEWAY_RECORD_HEADER_SIZE,
+                                     payload_length);
+        }
+        offset += record_length;
+    }
+    memmove(client->input, client->input + offset,
+            client->input_length - offset);
+    client->input_length -= offset;
+
+    // Frames are coalesced per link until the client's batch is handled
+    for (int i = 0; i < gw->link_count; i++) {
+        protocol_conn_flush(&gw->links[i]->conn);
+    }
+}
+
+static void *worker_run(void *arg) {
+    struct worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    bool stop = false;
+    while (!stop) {
+        int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            struct source *source = events[i].data.ptr;
+            switch (source->kind) {
+            case SOURCE_LINK:
+                if (events[i].events & EPOLLOUT) {
+                    write_link((struct link *)source);
+                }
+                if (events[i].events & ~EPOLLOUT) {
+                    read_link(w, (struct link *)source);
+                }
+                break;
+            case SOURCE_CLIENT:
+                if (events[i].events & EPOLLOUT) {
+                    write_client(w, (struct client *)source);
+                }
+                if (events[i].events & ~EPOLLOUT) {
+                    read_client(w, (struct client *)source);
+                }
+                break;
+            case SOURCE_LISTEN:
+                accept_client(w);
+                break;
+            case SOURCE_STOP:
+                // Left unread so that every worker sees it
+                stop = true;
+                break;
+            }
+        }
+        broadcast(w);
+    }
+    return NULL;
+}
+
+struct gateway *gateway_create(const char *socket_path, int workers) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (workers < 1 || strlen(socket_path) >= sizeof(addr.sun_path)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    struct gateway *gw = calloc(1, sizeof(*gw));
+    if (gw == NULL) {
+        return NULL;
+    }
+    strcpy(gw->socket_path, socket_path);
+    strcpy(addr.sun_path, socket_path);
+    pthread_mutex_init(&gw->clients_lock, NULL);
+
+    gw->listen.kind = SOURCE_LISTEN;
+    gw->listen.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    // Replace the socket of a gateway that did not shut down cleanly
+    unlink(socket_path);
+    if (gw->listen.fd < 0 ||
+        bind(gw->listen.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(gw->listen.fd, 16) < 0) {
+        goto fail;
+    }
+
+    int stop[2];
+    if (pipe2(stop, O_CLOEXEC | O_NONBLOCK) < 0) {
+        goto fail;
+    }
+    gw->stop.kind = SOURCE_STOP;
+    gw->stop.fd = stop[0];
+    gw->stop_write = stop[1];
+
+    gw->workers = calloc(workers, sizeof(*gw->workers));
+    if (gw->workers == NULL) {
+        goto fail;
+    }
+    gw->worker_count = workers;
+    for (int i = 0; i < workers; i++) {
+        struct worker *w = &gw->workers[i];
+        w->gw = gw;
+        w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (w->epoll_fd < 0 || epoll_add(w->epoll_fd, &gw->stop) < 0) {
+            goto fail;
+        }
+    }
+    // Clients are served by the first worker, which runs on the caller
+    if (epoll_add(gw->workers[0].epoll_fd, &gw->listen) < 0) {
+        goto fail;
+    }
+    return gw;
+
+fail:
+    gateway_destroy(gw);
+    return NULL;
+}
+
+int gateway_add_link(struct gateway *gw, int fd) {
+    if (gw->running) {
+        return -1;
+    }
+    struct link *link = calloc(1, sizeof(*link));
+    uint8_t *output = malloc(GATEWAY_LINK_QUEUE_SIZE);
+    struct link **links =
+        realloc(gw->links, (gw->link_count + 1) * sizeof(*links));
+    if (link == NULL || output == NULL || links == NULL) {
+        free(link);
+        free(output);
+        return -1;
+    }
+    gw->links = links;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    link->source.kind = SOURCE_LINK;
+    link->source.fd = fd;
+    link->index = gw->link_count;
+    atomic_init(&link->open, true);
+    atomic_init(&link->frames_dropped, 0);
+    link->output = output;
+    pthread_mutex_init(&link->output_lock, NULL);
+    // Links are dealt out to the workers in turn
+    struct worker *w = &gw->workers[link->index % gw->worker_count];
+    link->epoll_fd = w->epoll_fd;
+    if (epoll_add(w->epoll_fd, &link->source) < 0) {
+        pthread_mutex_destroy(&link->output_lock);
+        free(output);
+        free(link);
+        return -1;
+    }
+    protocol_conn_init(&link->conn, link_write, link);
+    atomic_init(&link->frame_size, protocol_conn_frame_size(&link->conn));
+    // Flushed explicitly once a client's records have been handled
+    protocol_conn_set_flush_deadline(&link->conn, PROTOCOL_NO_DEADLINE);
+    protocol_conn_send_open(&link->conn);
+    protocol_conn_flush(&link->conn);
+    gw->links[gw->link_count++] = link;
+    atomic_fetch_add(&gw->open_links, 1);
+    return link->index;
+}
+
+int gateway_run(struct gateway *gw) {
+    gw->running = true;
+    int started = 1;
+    int result = 0;
+    for (; started < gw->worker_count; started++) {
+        struct worker *w = &gw->workers[started];
+        if (pthread_create(&w->thread, NULL, worker_run, w) != 0) {
+            gateway_stop(gw);
+            result = -1;
+            break;
+        }
+    }
+    worker_run(&gw->workers[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(gw->workers[i].thread, NULL);
+    }
+    return result;
+}
+
+void gateway_stop(struct gateway *gw) {
+    // The pipe only has to become readable, a full pipe already is
+    ssize_t ignored = write(gw->stop_write, "", 1);
+    (void)ignored;
+}
+
+int gateway_link_count(const struct gateway *gw) { return gw->link_count; }
+
+const struct protocol_stats *gateway_link_stats(const struct gateway *gw,
+                                                int index) {
+    return protocol_conn_get_stats(&gw->links[index]->conn);
+}
+
+unsigned gateway_link_dropped(const struct gateway *gw, int index) {
+    return atomic_load(&gw->links[index]->frames_dropped);
+}
+
+void gateway_destroy(struct gateway *gw) {
+    for (int i = 0; i < gw->link_count; i++) {
+        close(gw->links[i]->source.fd);
+        pthread_mutex_destroy(&gw->links[i]->output_lock);
+        free(gw->links[i]->output);
+        free(gw->links[i]);
+    }
+    for (int i = 0; i < gw->client_count; i++) {
+        close(gw->clients[i]->source.fd);
+        free(gw->clients[i]->output);
+        free(gw->clients[i]);
+    }
+    for (int i = 0; i < gw->worker_count; i++) {
+        if (gw->workers[i].epoll_fd > 0) {
+            close(gw->workers[i].epoll_fd);
+        }
+    }
+    if (gw->listen.fd > 0) {
+        close(gw->listen.fd);
+        unlink(gw->socket_path);
+    }
+    if (gw->stop.fd > 0) {
+        close(gw->stop.fd);
+        close(gw->stop_write);
+    }
+    pthread_mutex_destroy(&gw->clients_lock);
+    free(gw->links);
+    free(gw->clients);
+    free(gw->workers);
+    free(gw);
+}
@@ -0,0 +1,75 @@
+#ifndef GATEWAY_H
+#define GATEWAY_H
+
+#include "protocol.h"
+
+/*
+ * Serves many device links from one process. Each link is a non-blocking
+ * file descriptor (serial port, pty or socket) with its own protocol_conn,
+ * driven from an epoll loop. Frames are exchanged with local clients over a
+ * Unix stream socket as records:
+ *
+ *   link     2 bytes  index of the link, in the order links were added
+ *   length   2 bytes  payload length
+ *   type     1 byte   frame type
+ *   payload  length bytes
+ *
+ * Numbers are big-endian, like the frame header. Every intact frame from a
+ * device is sent to every client; frames that fail a check are only counted
+ * in the link's statistics. A record from a client is framed and written to
+ * the link it names.
+ *
+ * Each link is opened with an 'o' frame carrying our capabilities when it is
+ * added, and the device's reply sets its frame size. A record whose frame
+ * would not fit that size is not sent; the client gets an 'a' record with
+ * the LENGTH code from that link instead, as if the device had refused it.
+ *
+ * Nothing blocks the gateway. Frames to a device that does not keep up are
+ * queued; once more than GATEWAY_LINK_QUEUE_SIZE bytes wait, further frames
+ * are dropped whole and counted. Output to each client is queued as well,
+ * and a client that falls more than GATEWAY_CLIENT_QUEUE_SIZE bytes behind
+ * is disconnected, so it cannot hold up the links or other clients.
+ *
+ * With more than one worker the links are split between worker threads, each
+ * with its own epoll instance, so a link is only ever parsed by one thread.
+ */
+
+#define GATEWAY_RECORD_HEADER_SIZE 5
+#define GATEWAY_DEFAULT_SOCKET "/tmp/pico-gateway.sock"
+
+// Bytes of records that may wait for one client before it is disconnected.
+#ifndef GATEWAY_CLIENT_QUEUE_SIZE
+#define GATEWAY_CLIENT_QUEUE_SIZE (4 << 20)
+#endif
+
+// Bytes of frames that may wait for one link before further frames are
+// dropped.
+#ifndef GATEWAY_LINK_QUEUE_SIZE
+#define GATEWAY_LINK_QUEUE_SIZE (64 << 10)
+#endif
+
+struct gateway;
+
+// Creates a gateway listening on socket_path, with the given number of
+// worker threads (at least 1). Returns NULL and sets errno on failure.
+struct gateway *gateway_create(const char *socket_path, int workers);
+// Adds a link and sends it an open request. The gateway makes fd
+// non-blocking and closes it when destroyed. Returns the link index, or -1
+// once the gateway is running or if the link could not be added.
+int gateway_add_link(struct gateway *gw, int fd);
+// Serves the links until gateway_stop is called or every link has hung up.
+// Returns 0, or -1 if a worker could not be started.
+int gateway_run(struct gateway *gw);
+// Makes gateway_run return. Safe to call from a signal handler.
+void gateway_stop(struct gateway *gw);
+// Returns the number of links.
+int gateway_link_count(const struct gateway *gw);
+// Returns the receive statistics of a link.
+const struct protocol_stats *gateway_link_stats(const struct gateway *gw,
+                                                int index);
+// Returns the number of frames to a link dropped because its queue was full.
+unsigned gateway_link_dropped(const struct gateway *gw, int index);
+// Closes every link and client and frees the gateway.
+void gateway_destroy(struct gateway *gw);
+
+#endif
@@ -0,0 +1,97 @@
+#include "gateway.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+/*
+ * Serves many Picos from one process.
+ *
+ *   gateway [-w workers] [-s socket] /dev/ttyACM0 /dev/ttyACM1 ...
+ *
+ * Links are numbered in the order given. Clients connect to the Unix socket
+ * (GATEWAY_DEFAULT_SOCKET unless -s is given) and exchange records as
+ * described in gateway.h, e.g. with GatewayClient in protocol.py. Stop with
+ * Ctrl-C; the receive statistics of every link are printed on exit.
+ */
+
+static struct gateway *gateway;
+
+static void on_signal(int sig) { gateway_stop(gateway); }
+
+int main(int argc, char **argv) {
+    const char *socket_path = GATEWAY_DEFAULT_SOCKET;
+    int workers = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:s:")) != -1) {
+        switch (opt) {
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 's':
+            socket_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-w workers] [-s socket] <device>...\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (optind == argc) {
+        fprintf(stderr, "usage: %s [-w workers] [-s socket] <device>...\n",
+                argv[0]);
+        return 2;
+    }
+
+    gateway = gateway_create(socket_path, workers);
+    if (gateway == NULL) {
+        perror(socket_path);
+        return 1;
+    }
+    for (int i = optind; i < argc; i++) {
+        int fd = open(argv[i], O_RDWR | O_NOCTTY | O_CLOEXEC);
+        if (fd < 0) {
+            perror(argv[i]);
+            gateway_destroy(gateway);
+            return 1;
+        }
+        // Plain files and sockets have no line settings to change
+        struct termios tio;
+        if (tcgetattr(fd, &tio) == 0) {
+            cfmakeraw(&tio);
+            tcsetattr(fd, TCSANOW, &tio);
+        }
+        int index = gateway_add_link(gateway, fd);
+        if (index < 0) {
+            fprintf(stderr, "%s: could not add link\n", argv[i]);
+            close(fd);
+            gateway_destroy(gateway);
+            return 1;
+        }
+        printf("link %d: %s\n", index, argv[i]);
+    }
+    printf("serving %d link(s) on %s with %d worker(s)\n",
+           gateway_link_count(gateway), socket_path, workers);
+    fflush(stdout);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+    gateway_run(gateway);
+
+    printf("%-6s %12s %10s %10s %10s %10s\n", "link", "bytes", "frames",
+           "rejected", "resyncs", "dropped");
+    for (int i = 0; i < gateway_link_count(gateway); i++) {
+        const struct protocol_stats *stats = gateway_link_stats(gateway, i);
+        uint32_t rejected = 0;
+        for (int e = 0; e < PROTOCOL_ERROR_COUNT; e++) {
+            rejected += stats->errors[e];
+        }
+        printf("%-6d %12llu %10u %10u %10u %10u\n", i,
+               (unsigned long long)stats->bytes, stats->frames, rejected,
+               stats->resyncs, gateway_link_dropped(gateway, i));
+    }
+    gateway_destroy(gateway);
+    return 0;
+}
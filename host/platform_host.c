@@ -0,0 +1,129 @@
+#include "platform_host.h"
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+static int in_fd = 0;
+static int out_fd = 1;
+static platform_read_fn read_hook;
+static platform_write_fn write_hook;
+static void *hook_ctx;
+static bool led;
+
+// Bytes read from in_fd but not returned yet
+static uint8_t in_buffer[4096];
+static size_t in_head;
+static size_t in_tail;
+
+void platform_host_set_fds(int in, int out) {
+    in_fd = in;
+    out_fd = out;
+    in_head = 0;
+    in_tail = 0;
+    read_hook = NULL;
+    write_hook = NULL;
+}
+
+void platform_host_set_io(platform_read_fn read, platform_write_fn write,
+                          void *ctx) {
+    read_hook = read;
+    write_hook = write;
+    hook_ctx = ctx;
+}
+
+bool platform_host_led() { return led; }
+
+void platform_init(void) { led = false; }
+
+/**
+ * @brief Reads one byte from the input descriptor or the read hook.
+ *
+ * @param timeout_us Maximum time to wait, or PLATFORM_WAIT_FOREVER.
+ * @return The byte read, or PLATFORM_TIMEOUT on timeout or end of input.
+ */
+int platform_getc(uint32_t timeout_us) {
+    if (read_hook) {
+        return read_hook(hook_ctx, timeout_us);
+    }
+    if (in_head < in_tail) {
+        return in_buffer[in_head++];
+    }
+    struct pollfd pfd = {.fd = in_fd, .events = POLLIN};
+    int timeout_ms = -1;
+    if (timeout_us != PLATFORM_WAIT_FOREVER) {
+        timeout_ms = (timeout_us + 999) / 1000;
+    }
+    int ready;
+    do {
+        ready = poll(&pfd, 1, timeout_ms);
+    } while (ready < 0 && errno == EINTR);
+    if (ready <= 0) {
+        return PLATFORM_TIMEOUT;
+    }
+    // Read whatever is available, one syscall per chunk rather than per byte
+    ssize_t n = read(in_fd, in_buffer, sizeof(in_buffer));
+    if (n <= 0) {
+        return PLATFORM_TIMEOUT;
+    }
+    in_head = 1;
+    in_tail = n;
+    return in_buffer[0];
+}
+
+/**
+ * @brief Writes a buffer to the output descriptor or the write hook.
+ *
+ * @param data Pointer to the bytes to send.
+ * @param len Number of bytes to send.
+ * @return The number of bytes written.
+ */
+int platform_write(const uint8_t *data, size_t len) {
+    if (write_hook) {
+        return write_hook(hook_ctx, data, len);
+    }
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(out_fd, data + written, len - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        written += n;
+    }
+    return written;
+}
+
+uint64_t platform_time_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// The stopwatch counts nanoseconds, there is no portable cycle counter
+static struct timespec stopwatch;
+
+void platform_stopwatch_start(void) {
+    clock_gettime(CLOCK_MONOTONIC, &stopwatch);
+}
+
+uint32_t platform_stopwatch_ticks(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t ns = (int64_t)(now.tv_sec - stopwatch.tv_sec) * 1000000000 +
+                 (now.tv_nsec - stopwatch.tv_nsec);
+    return ns < UINT32_MAX ? ns : UINT32_MAX;
+}
+
+uint32_t platform_stopwatch_hz(void) { return 1000000000; }
+
+void platform_set_led(bool on) { led = on; }
+
+// Threads have no cheap way to wait for each other's stores, so waiting only
+// hands the processor to whoever else is ready
+void platform_wait_event(void) { sched_yield(); }
+
+void platform_signal_event(void) {}
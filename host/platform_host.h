@@ -0,0 +1,20 @@
+#ifndef PLATFORM_HOST_H
+#define PLATFORM_HOST_H
+
+#include "platform.h"
+
+// Reads one byte, waiting at most timeout_us. Returns the byte or
+// PLATFORM_TIMEOUT.
+typedef int (*platform_read_fn)(void *ctx, uint32_t timeout_us);
+// Writes len bytes. Returns the number of bytes written.
+typedef int (*platform_write_fn)(void *ctx, const uint8_t *data, size_t len);
+
+// Uses the given file descriptors as the link (stdin/stdout by default).
+void platform_host_set_fds(int in_fd, int out_fd);
+// Routes the link through callbacks, used by tests and benchmarks.
+void platform_host_set_io(platform_read_fn read, platform_write_fn write,
+                          void *ctx);
+// Returns the last state set with platform_set_led().
+bool platform_host_led();
+
+#endif
@@ -0,0 +1,204 @@
+#include "capture.h"
+#include "platform_host.h"
+#include "protocol.h"
+#include "schema.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Replays a capture through the receive path of protocol.c at full speed.
+ *
+ *   replay [-t] [-n rounds] [-x] board.picocap
+ *
+ *   -t         replay the bytes sent to the device instead of those it sent
+ *   -n rounds  replay the capture this many times, for stable timings
+ *   -x         also dispatch every intact frame to its handler, with all
+ *              output discarded
+ *
+ * The capture is mapped into memory and each record is handed to the parser
+ * as one chunk, so the numbers measure the parser and not the file system.
+ * Reports throughput, frames, rejected frames by error code, stray start
+ * markers and resyncs.
+ */
+
+static const char *error_names[PROTOCOL_ERROR_COUNT] = {
+    [CRC] = "CRC",       [VERSION] = "VERSION", [ENDING] = "ENDING",
+    [TYPE] = "TYPE",     [OPENED] = "OPENED",   [CLOSED] = "CLOSED",
+    [LENGTH] = "LENGTH",
+};
+
+static int discard_write(void *ctx, const uint8_t *data, size_t len) {
+    return len;
+}
+
+static int no_read(void *ctx, uint32_t timeout_us) {
+    if (timeout_us == PLATFORM_WAIT_FOREVER) {
+        // A handler such as 't' waits for input a capture cannot provide
+        fprintf(stderr, "a handler tried to read from the link\n");
+        exit(1);
+    }
+    return PLATFORM_TIMEOUT;
+}
+
+int main(int argc, char **argv) {
+    uint8_t direction = CAPTURE_FROM_DEVICE;
+    long rounds = 1;
+    int dispatch = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "tn:x")) != -1) {
+        switch (opt) {
+        case 't':
+            direction = CAPTURE_TO_DEVICE;
+            break;
+        case 'n':
+            rounds = strtol(optarg, NULL, 0);
+            break;
+        case 'x':
+            dispatch = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t] [-n rounds] [-x] <capture file>\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1 || rounds < 1) {
+        fprintf(stderr, "usage: %s [-t] [-n rounds] [-x] <capture file>\n",
+                argv[0]);
+        return 2;
+    }
+
+    const char *path = argv[optind];
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        return 1;
+    }
+    size_t size = st.st_size;
+    if (size < CAPTURE_HEADER_SIZE) {
+        fprintf(stderr, "%s: not a capture\n", path);
+        return 1;
+    }
+    const uint8_t *file = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    madvise((void *)file, size, MADV_SEQUENTIAL);
+    if (memcmp(file, CAPTURE_MAGIC, 7) != 0 ||
+        file[7] != CAPTURE_VERSION) {
+        fprintf(stderr, "%s: not a version %d capture\n", path,
+                CAPTURE_VERSION);
+        return 1;
+    }
+
+    // Index the records once so the timed loop only touches payload bytes
+    size_t records = 0;
+    size_t capacity = 1024;
+    struct {
+        const uint8_t *data;
+        uint32_t length;
+    } *chunks = malloc(capacity * sizeof(*chunks));
+    if (chunks == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    uint64_t bytes = 0;
+    uint64_t duration_us = 0;
+    for (size_t offset = CAPTURE_HEADER_SIZE; offset < size;) {
+        if (size - offset < CAPTURE_RECORD_SIZE) {
+            fprintf(stderr, "%s: truncated record header\n", path);
+            break;
+        }
+        const uint8_t *header = file + offset;
+        uint32_t length = schema_load_u32(header + 8);
+        offset += CAPTURE_RECORD_SIZE;
+        if (length > size - offset) {
+            fprintf(stderr, "%s: truncated record\n", path);
+            break;
+        }
+        duration_us = schema_load_u64(header);
+        if (header[12] == direction && length > 0) {
+            if (records == capacity) {
+                capacity *= 2;
+                void *grown = realloc(chunks, capacity * sizeof(*chunks));
+                if (grown == NULL) {
+                    perror("realloc");
+                    free(chunks);
+                    return 1;
+                }
+                chunks = grown;
+            }
+            chunks[records].data = file + offset;
+            chunks[records].length = length;
+            records++;
+            bytes += length;
+        }
+        offset += length;
+    }
+
+    // Keep handler output from mixing with the report
+    int stdout_fd = dup(1);
+    if (dispatch) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        close(null);
+    }
+
+    protocol_init();
+    platform_host_set_io(no_read, discard_write, NULL);
+    struct protocol_stats total = {0};
+    uint64_t start = platform_time_us();
+    for (long r = 0; r < rounds; r++) {
+        // Start each round from a fresh link, so a capture that ends in the
+        // middle of a frame does not run into the next round
+        protocol_flush();
+        protocol_conn_init(&protocol_default, NULL, NULL);
+        for (size_t i = 0; i < records; i++) {
+            const uint8_t *data = chunks[i].data;
+            size_t length = chunks[i].length;
+            if (dispatch) {
+                protocol_receive_bytes(data, length);
+                continue;
+            }
+            while (length > 0) {
+                struct protocol_frame frame;
+                size_t n = protocol_parse(data, length, &frame);
+                data += n;
+                length -= n;
+            }
+        }
+        total = *protocol_get_stats();
+    }
+    uint64_t elapsed = platform_time_us() - start;
+
+    fflush(stdout);
+    dup2(stdout_fd, 1);
+    if (elapsed == 0) {
+        elapsed = 1;
+    }
+    printf("%s: %zu records, %llu bytes %s the device over %.3f s\n", path,
+           records, (unsigned long long)bytes,
+           direction == CAPTURE_FROM_DEVICE ? "from" : "to",
+           duration_us / 1e6);
+    printf("replayed %ld time(s)%s in %.3f s\n", rounds,
+           dispatch ? " with dispatch" : "", elapsed / 1e6);
+    printf("throughput:    %.1f MB/s, %.0f frames/s\n",
+           (double)bytes * rounds / elapsed,
+           (double)(total.frames + 0.0) * rounds * 1e6 / elapsed);
+    printf("frames:        %u intact\n", total.frames);
+    for (int e = 0; e < PROTOCOL_ERROR_COUNT; e++) {
+        if (total.errors[e] > 0) {
+            printf("error %-8s %u\n", error_names[e], total.errors[e]);
+        }
+    }
+    printf("stray markers: %u\n", total.stray_markers);
+    printf("resyncs:       %u, %llu bytes skipped\n", total.resyncs,
+           (unsigned long long)total.bytes_skipped);
+    return 0;
+}
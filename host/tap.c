@@ -0,0 +1,128 @@
+#define _GNU_SOURCE
+#include "capture.h"
+#include "platform_host.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+/*
+ * Sits between a Pico and the program talking to it, and records every byte
+ * in both directions to a capture file.
+ *
+ *   tap /dev/ttyACM0 board.picocap
+ *
+ * prints the path of a pseudo terminal; point the program at that path
+ * instead of the real device, e.g. CustomProtocol(address="/dev/pts/5").
+ * Stop with Ctrl-C.
+ */
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig) { stop = 1; }
+
+static int make_raw(int fd) {
+    struct termios tio;
+    if (tcgetattr(fd, &tio) < 0) {
+        return -1;
+    }
+    cfmakeraw(&tio);
+    return tcsetattr(fd, TCSANOW, &tio);
+}
+
+// Forwards one chunk from in to out and records it. Returns -1 once in is
+// closed.
+static int forward(int in, int out, uint8_t direction, FILE *capture,
+                   uint64_t start) {
+    uint8_t buffer[4096];
+    ssize_t n = read(in, buffer, sizeof(buffer));
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return 0;
+    }
+    if (n <= 0) {
+        return -1;
+    }
+    capture_write_record(capture, platform_time_us() - start, direction,
+                         buffer, n);
+    for (ssize_t written = 0; written < n;) {
+        ssize_t w = write(out, buffer + written, n - written);
+        if (w < 0 && errno != EINTR) {
+            return -1;
+        }
+        written += w > 0 ? w : 0;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <device> <capture file>\n", argv[0]);
+        return 2;
+    }
+
+    int device = open(argv[1], O_RDWR | O_NOCTTY);
+    if (device < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    // The device may also be a plain file or pipe, which has no line settings
+    make_raw(device);
+
+    int pty = posix_openpt(O_RDWR | O_NOCTTY);
+    if (pty < 0 || grantpt(pty) < 0 || unlockpt(pty) < 0) {
+        perror("pty");
+        return 1;
+    }
+    // Keep the slave open so reads do not fail between client connections
+    int slave = open(ptsname(pty), O_RDWR | O_NOCTTY);
+    if (slave < 0 || make_raw(slave) < 0) {
+        perror(ptsname(pty));
+        return 1;
+    }
+
+    FILE *capture = fopen(argv[2], "wb");
+    if (capture == NULL || capture_write_header(capture) < 0) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    printf("%s\n", ptsname(pty));
+    fflush(stdout);
+
+    uint64_t start = platform_time_us();
+    struct pollfd fds[2] = {
+        {.fd = device, .events = POLLIN},
+        {.fd = pty, .events = POLLIN},
+    };
+    while (!stop) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        if (fds[0].revents &&
+            forward(device, pty, CAPTURE_FROM_DEVICE, capture, start) < 0) {
+            fprintf(stderr, "device closed\n");
+            break;
+        }
+        if (fds[1].revents &&
+            forward(pty, device, CAPTURE_TO_DEVICE, capture, start) < 0) {
+            fprintf(stderr, "pty closed\n");
+            break;
+        }
+    }
+
+    fclose(capture);
+    close(slave);
+    close(pty);
+    close(device);
+    return 0;
+}
@@ -0,0 +1,149 @@
+#include "platform_host.h"
+#include "protocol.h"
+#include "tests.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Runs the on-device unit tests on the host. The link is routed through a
+ * peer that answers frames the same way protocol.py does: open requests are
+ * answered with its capabilities, close is echoed back, echo requests are
+ * answered with a data frame, and a bad CRC is reported with an ack before
+ * the frame is handled. Test results ("N t" or
+ * "N f") are collected from the data frames the device side sends.
+ */
+
+#define QUEUE_SIZE 65536
+
+struct peer {
+    // Bytes queued for the device to receive
+    uint8_t input[QUEUE_SIZE];
+    size_t input_head;
+    size_t input_tail;
+    // Bytes the device sent that do not form a whole frame yet
+    uint8_t output[QUEUE_SIZE];
+    size_t output_length;
+    // Result of each test, indexed by test number
+    char results[64];
+};
+
+static void peer_send(struct peer *peer, uint8_t type, const uint8_t *payload,
+                      size_t payload_length) {
+    size_t packet_length = payload_length + 7;
+    uint8_t *packet = peer->input + peer->input_tail;
+    if (peer->input_tail + packet_length > QUEUE_SIZE) {
+        fprintf(stderr, "peer input queue overflow\n");
+        exit(1);
+    }
+    peer->input_tail +=
+        protocol_encode_frame(packet, type, payload, payload_length);
+}
+
+static void peer_handle(struct peer *peer, uint8_t *packet,
+                        size_t packet_length) {
+    uint8_t type = packet[4];
+    uint8_t *payload = packet + 5;
+    size_t payload_length = packet_length - 7;
+
+    uint8_t received_crc = packet[packet_length - 2];
+    packet[packet_length - 2] = 0;
+    if (compute_crc(packet, packet_length) != received_crc) {
+        uint8_t err = CRC;
+        peer_send(peer, 'a', &err, 1);
+    }
+
+    switch (type) {
+    case 'o': {
+        // Open requests are answered with capabilities, replies are not
+        uint8_t caps[PROTOCOL_CAPS_SIZE] = {
+            0, 2, 2, 0xFF, 0xFF, 1, PROTOCOL_CHECKSUM_CRC8,
+            PROTOCOL_COMPRESSION_NONE, PROTOCOL_FRAMING_MARKERS};
+        if (payload_length >= PROTOCOL_CAPS_SIZE &&
+            payload[0] & PROTOCOL_CAPS_REPLY) {
+            break;
+        }
+        if (payload_length >= PROTOCOL_CAPS_SIZE) {
+            caps[0] = PROTOCOL_CAPS_REPLY;
+        }
+        peer_send(peer, 'o', caps, sizeof(caps));
+        break;
+    }
+    case 'c':
+        peer_send(peer, type, NULL, 0);
+        break;
+    case 'e':
+        peer_send(peer, 'd', payload, payload_length);
+        break;
+    case 'd': {
+        int test;
+        char result;
+        char text[16] = {0};
+        if (payload_length < sizeof(text)) {
+            memcpy(text, payload, payload_length);
+        }
+        if (sscanf(text, "%d %c", &test, &result) == 2 && test > 0 &&
+            test < (int)sizeof(peer->results)) {
+            peer->results[test] = result;
+        }
+        break;
+    }
+    }
+}
+
+static int peer_write(void *ctx, const uint8_t *data, size_t len) {
+    struct peer *peer = ctx;
+    for (size_t i = 0; i < len; i++) {
+        // Skip anything outside a frame, as protocol.py does
+        if (peer->output_length == 0 && data[i] != 0xAA) {
+            continue;
+        }
+        peer->output[peer->output_length++] = data[i];
+        if (peer->output_length < 3) {
+            continue;
+        }
+        size_t packet_length = (peer->output[1] << 8) | peer->output[2];
+        if (packet_length < 7 || packet_length > QUEUE_SIZE) {
+            peer->output_length = 0;
+        } else if (peer->output_length == packet_length) {
+            peer_handle(peer, peer->output, packet_length);
+            peer->output_length = 0;
+        }
+    }
+    return len;
+}
+
+static int peer_read(void *ctx, uint32_t timeout_us) {
+    struct peer *peer = ctx;
+    if (peer->input_head == peer->input_tail) {
+        if (timeout_us == PLATFORM_WAIT_FOREVER) {
+            fprintf(stderr, "receive blocked with nothing left to read\n");
+            exit(1);
+        }
+        return PLATFORM_TIMEOUT;
+    }
+    return peer->input[peer->input_head++];
+}
+
+int main() {
+    static struct peer peer;
+    protocol_init();
+    platform_host_set_io(peer_read, peer_write, &peer);
+
+    run_tests();
+    protocol_flush();
+
+    int failed = 0;
+    int count = 0;
+    for (size_t i = 1; i < sizeof(peer.results); i++) {
+        if (peer.results[i] == 0) {
+            continue;
+        }
+        count++;
+        if (peer.results[i] != 't') {
+            printf("test %zu failed\n", i);
+            failed++;
+        }
+    }
+    printf("%d of %d tests passed\n", count - failed, count);
+    return failed || count == 0;
+}
@@ -0,0 +1,165 @@
+#include "pipeline.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * Runs the two pipeline stages on two threads, the way they run on the two
+ * cores of the RP2040. The receiver is fed a long stream in chunks of random
+ * size, with junk and corrupted frames mixed in. The dispatcher hands intact
+ * frames to a handler that checks they arrive whole and in order, and
+ * acknowledges corrupted ones through the connection's write function.
+ */
+
+#define FRAMES 200000
+#define TYPE 'q'
+// Every CORRUPT_EVERY-th frame has a bad CRC
+#define CORRUPT_EVERY 97
+// Junk is inserted in front of every JUNK_EVERY-th frame
+#define JUNK_EVERY 101
+
+static struct protocol_conn conn;
+static struct pipeline pipeline;
+static atomic_bool done;
+
+static uint8_t *stream;
+static size_t stream_length;
+
+static uint32_t next_sequence;
+static int failures;
+static int crc_acks;
+
+// Payloads hold a little-endian sequence number followed by its low byte,
+// repeated up to a length that varies from frame to frame
+static void handle(const uint8_t *payload, size_t payload_length) {
+    uint32_t sequence = payload[0] | payload[1] << 8 | payload[2] << 16 |
+                        (uint32_t)payload[3] << 24;
+    bool ok = sequence == next_sequence &&
+              payload_length == 4 + sequence % 60;
+    for (size_t i = 4; ok && i < payload_length; i++) {
+        ok = payload[i] == (uint8_t)sequence;
+    }
+    if (!ok && failures++ < 10) {
+        fprintf(stderr, "frame %u out of order or damaged\n", next_sequence);
+    }
+    next_sequence = sequence + 1;
+}
+
+static int count_acks(void *io, const uint8_t *data, size_t len) {
+    if (len == 8 && data[4] == 'a' && data[5] == CRC) {
+        crc_acks++;
+    }
+    return len;
+}
+
+static size_t append_frame(uint8_t *out, uint32_t sequence, bool corrupt) {
+    size_t payload_length = 4 + sequence % 60;
+    uint8_t payload[64];
+    payload[0] = sequence;
+    payload[1] = sequence >> 8;
+    payload[2] = sequence >> 16;
+    payload[3] = sequence >> 24;
+    memset(payload + 4, (uint8_t)sequence, payload_length - 4);
+    size_t packet_length =
+        protocol_encode_frame(out, TYPE, payload, payload_length);
+    out[packet_length - 2] ^= corrupt;
+    return packet_length;
+}
+
+static void *receiver(void *arg) {
+    srand(1);
+    for (size_t offset = 0; offset < stream_length;) {
+        size_t chunk = 1 + rand() % 200;
+        if (chunk > stream_length - offset) {
+            chunk = stream_length - offset;
+        }
+        size_t n = pipeline_receive(&pipeline, stream + offset, chunk);
+        if (n == 0) {
+            sched_yield();
+        }
+        offset += n;
+    }
+    // The last frame may still wait for room in the ring
+    while (pipeline.pending.length > 0) {
+        pipeline_receive(&pipeline, NULL, 0);
+        sched_yield();
+    }
+    atomic_store(&done, true);
+    return NULL;
+}
+
+static void *dispatcher(void *arg) {
+    for (;;) {
+        // Check for the end first, so no frame can slip in after the check
+        bool finished = atomic_load(&done);
+        if (pipeline_dispatch(&pipeline)) {
+            continue;
+        }
+        if (finished) {
+            break;
+        }
+        sched_yield();
+    }
+    return NULL;
+}
+
+int main() {
+    stream = malloc(FRAMES * (64 + 7 + 5));
+    int good = 0;
+    int corrupted = 0;
+    int junk = 0;
+    uint32_t sequence = 0;
+    for (int i = 0; i < FRAMES; i++) {
+        if (i % JUNK_EVERY == 0) {
+            memcpy(stream + stream_length, "junk!", 5);
+            stream_length += 5;
+            junk++;
+        }
+        bool corrupt = i % CORRUPT_EVERY == CORRUPT_EVERY - 1;
+        stream_length +=
+            append_frame(stream + stream_length, sequence, corrupt);
+        if (corrupt) {
+            corrupted++;
+        } else {
+            good++;
+        }
+        // A corrupted frame reuses its number, so the sequence has no gaps
+        sequence += !corrupt;
+    }
+
+    protocol_conn_init(&conn, count_acks, NULL);
+    protocol_conn_set_flush_deadline(&conn, 0);
+    protocol_register_handler(TYPE, PROTOCOL_ANY_SIZE, handle);
+    pipeline_init(&pipeline, &conn);
+
+    // Keep the messages printed for corrupted frames out of the test log
+    fflush(stdout);
+    int stdout_fd = dup(1);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    close(null);
+
+    pthread_t threads[2];
+    pthread_create(&threads[0], NULL, receiver, NULL);
+    pthread_create(&threads[1], NULL, dispatcher, NULL);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+    fflush(stdout);
+    dup2(stdout_fd, 1);
+
+    const struct protocol_stats *stats = protocol_conn_get_stats(&conn);
+    printf("%u frames, %d acknowledged as corrupted, %u resyncs, %u stalls\n",
+           next_sequence, crc_acks, stats->resyncs, pipeline.stalls);
+    if (next_sequence != (uint32_t)good || stats->frames != (uint32_t)good ||
+        crc_acks != corrupted || stats->errors[CRC] != (uint32_t)corrupted ||
+        stats->resyncs != (uint32_t)junk || stats->bytes != stream_length) {
+        printf("expected %d frames, %d corrupted, %d resyncs\n", good,
+               corrupted, junk);
+        failures++;
+    }
+    free(stream);
+    return failures != 0;
+}
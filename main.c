@@ -1,13 +1,29 @@
 #include "hardware/gpio.h"
 #include "pico/stdlib.h"
+#include "pipeline.h"
 #include "protocol.h"
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
+#ifdef PROTOCOL_PIPELINE
+#include "pico/multicore.h"
+
+static struct pipeline pipeline;
+
+// Handlers run on core 1, so a slow one does not stop core 0 from draining
+// the USB input
+static void core1_main() { pipeline_run_dispatcher(&pipeline); }
+#endif
+
 int main() {
     protocol_init();
+#ifdef PROTOCOL_PIPELINE
+    pipeline_init(&pipeline, &protocol_default);
+    multicore_launch_core1(core1_main);
+    pipeline_run_receiver(&pipeline);
+#endif
     while (1) {
         char h[] = "hello world!";
         // protocol_receive();
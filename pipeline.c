@@ -0,0 +1,214 @@
+#include "pipeline.h"
+#include "platform.h"
+
+// Largest burst the receiver reads before handing it to the parser
+#define RECEIVE_BURST 64
+
+/**
+ * @brief Sets up a pipeline for a connection.
+ *
+ * @param p The pipeline.
+ * @param conn The connection whose frames go through the pipeline.
+ */
+void pipeline_init(struct pipeline *p, struct protocol_conn *conn) {
+    p->conn = conn;
+    atomic_init(&p->head, 0);
+    atomic_init(&p->tail, 0);
+    p->next_tail = 0;
+    p->pending.length = 0;
+    p->stalls = 0;
+}
+
+/**
+ * @brief Copies a frame into the ring.
+ *
+ * @param p The pipeline.
+ * @param frame A frame completed by protocol_conn_parse.
+ * @return true if the frame was added, false if the ring is full.
+ *
+ * @note A record is never split across the end of the ring, so the dispatch
+ *       stage can hand out frames in place. If it does not fit in front of
+ *       the end, a record of length 0 marks the rest as unused and the
+ *       record goes to the start of the ring.
+ */
+static bool push(struct pipeline *p, const struct protocol_frame *frame) {
+    uint32_t head = atomic_load_explicit(&p->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&p->tail, memory_order_acquire);
+    uint32_t offset = head % PIPELINE_RING_SIZE;
+    uint32_t to_end = PIPELINE_RING_SIZE - offset;
+    uint32_t size = PIPELINE_RECORD_HEADER_SIZE + frame->length;
+    uint32_t needed = size <= to_end ? size : to_end + size;
+    if (PIPELINE_RING_SIZE - (head - tail) < needed) {
+        return false;
+    }
+
+    if (size > to_end) {
+        // Too little room for a header is skipped without a marker
+        if (to_end >= PIPELINE_RECORD_HEADER_SIZE) {
+            p->ring[offset] = 0;
+            p->ring[offset + 1] = 0;
+        }
+        head += to_end;
+        offset = 0;
+    }
+    uint8_t *record = p->ring + offset;
+    record[0] = frame->length >> 8;
+    record[1] = frame->length;
+    record[2] = frame->error;
+    memcpy(record + PIPELINE_RECORD_HEADER_SIZE, frame->packet, frame->length);
+    // Publish the record only once it is complete
+    atomic_store_explicit(&p->head, head + size, memory_order_release);
+    platform_signal_event();
+    return true;
+}
+
+/**
+ * @brief Parses received bytes and moves completed frames into the ring.
+ *
+ * @param p The pipeline.
+ * @param data Pointer to the received bytes.
+ * @param len Number of bytes.
+ * @return The number of bytes consumed.
+ *
+ * @note When the ring is full the bytes after the frame that did not fit are
+ *       left alone, and the caller should offer them again later. Frames
+ *       that failed a check are passed on too, so that the dispatch stage,
+ *       which owns the output side of the connection, can acknowledge them.
+ */
+size_t pipeline_receive(struct pipeline *p, const uint8_t *data, size_t len) {
+    if (p->pending.length > 0) {
+        if (!push(p, &p->pending)) {
+            p->stalls++;
+            return 0;
+        }
+        p->pending.length = 0;
+    }
+
+    size_t consumed = 0;
+    while (consumed < len) {
+        struct protocol_frame frame;
+        consumed += protocol_conn_parse(p->conn, data + consumed,
+                                        len - consumed, &frame);
+        if (frame.length > 0 && !push(p, &frame)) {
+            // Keep the frame; the parser does not touch it until called again
+            p->pending = frame;
+            p->stalls++;
+            break;
+        }
+    }
+    return consumed;
+}
+
+/**
+ * @brief Returns the oldest frame in the ring without removing it.
+ *
+ * @param p The pipeline.
+ * @param frame Set to the frame, which points into the ring and stays valid
+ *        until pipeline_release.
+ * @return true if there was a frame, false if the ring is empty.
+ */
+bool pipeline_peek(struct pipeline *p, struct protocol_frame *frame) {
+    uint32_t tail = atomic_load_explicit(&p->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&p->head, memory_order_acquire);
+    if (tail == head) {
+        return false;
+    }
+
+    uint32_t offset = tail % PIPELINE_RING_SIZE;
+    uint32_t to_end = PIPELINE_RING_SIZE - offset;
+    // Follow a skip to the start of the ring, there is always a record there
+    if (to_end < PIPELINE_RECORD_HEADER_SIZE ||
+        (p->ring[offset] == 0 && p->ring[offset + 1] == 0)) {
+        tail += to_end;
+        offset = 0;
+    }
+    const uint8_t *record = p->ring + offset;
+    frame->length = record[0] << 8 | record[1];
+    frame->error = record[2];
+    frame->packet = record + PIPELINE_RECORD_HEADER_SIZE;
+    p->next_tail = tail + PIPELINE_RECORD_HEADER_SIZE + frame->length;
+    return true;
+}
+
+/**
+ * @brief Removes the frame returned by pipeline_peek, making room for the
+ *        receive stage.
+ *
+ * @param p The pipeline.
+ */
+void pipeline_release(struct pipeline *p) {
+    atomic_store_explicit(&p->tail, p->next_tail, memory_order_release);
+    platform_signal_event();
+}
+
+/**
+ * @brief Dispatches or acknowledges the oldest frame in the ring.
+ *
+ * @param p The pipeline.
+ * @return true if a frame was handled, false if the ring is empty.
+ *
+ * @note The frame is handed to its handler in place and only released once
+ *       the handler returns.
+ */
+bool pipeline_dispatch(struct pipeline *p) {
+    struct protocol_frame frame;
+    if (!pipeline_peek(p, &frame)) {
+        return false;
+    }
+    protocol_conn_handle_frame(p->conn, &frame);
+    pipeline_release(p);
+    return true;
+}
+
+/**
+ * @brief Runs the receive stage on the platform link forever.
+ *
+ * @param p The pipeline.
+ *
+ * @note Waits for one byte, then takes whatever else is ready, so bytes are
+ *       parsed in bursts. While the ring is full it waits for the dispatch
+ *       stage to release a frame before offering the rest of the burst
+ *       again, and leaves further input in the platform's buffers.
+ */
+void pipeline_run_receiver(struct pipeline *p) {
+    uint8_t burst[RECEIVE_BURST];
+    for (;;) {
+        size_t length = 0;
+        burst[length++] = platform_getc(PLATFORM_WAIT_FOREVER);
+        int c;
+        while (length < RECEIVE_BURST &&
+               (c = platform_getc(0)) != PLATFORM_TIMEOUT) {
+            burst[length++] = c;
+        }
+        for (size_t offset = 0; offset < length;) {
+            size_t consumed =
+                pipeline_receive(p, burst + offset, length - offset);
+            if (consumed == 0) {
+                platform_wait_event();
+            }
+            offset += consumed;
+        }
+    }
+}
+
+/**
+ * @brief Runs the dispatch stage forever.
+ *
+ * @param p The pipeline.
+ *
+ * @note Output is flushed as soon as the ring runs empty, since the other
+ *       side may be waiting for a reply before it sends anything more, and
+ *       otherwise whenever its flush deadline passes. With nothing in the
+ *       ring and nothing left to send, it waits for the receive stage to
+ *       push a frame instead of spinning.
+ */
+void pipeline_run_dispatcher(struct pipeline *p) {
+    for (;;) {
+        if (pipeline_dispatch(p)) {
+            protocol_conn_poll(p->conn);
+        } else {
+            protocol_conn_flush(p->conn);
+            platform_wait_event();
+        }
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "protocol.h"
+#include <stdatomic.h>
+
+// Size of the ring between the receive and dispatch stages. Must be a power
+// of two and hold at least two frames of the largest size.
+#ifndef PIPELINE_RING_SIZE
+#define PIPELINE_RING_SIZE 4096
+#endif
+
+// Bytes in front of each frame in the ring: length (2 bytes) and error code.
+#define PIPELINE_RECORD_HEADER_SIZE 3
+
+_Static_assert((PIPELINE_RING_SIZE & (PIPELINE_RING_SIZE - 1)) == 0,
+               "PIPELINE_RING_SIZE must be a power of two");
+_Static_assert(PIPELINE_RING_SIZE >=
+                   2 * (PIPELINE_RECORD_HEADER_SIZE + PROTOCOL_MAX_FRAME_SIZE),
+               "PIPELINE_RING_SIZE must hold two frames of the largest size");
+
+// Splits the receive path of a connection in two stages joined by a
+// single-producer, single-consumer ring. The receive stage parses and checks
+// incoming bytes and moves completed frames into the ring; the dispatch
+// stage runs the handlers. Each stage may run on its own core or thread,
+// without locks: only the receive stage writes head and the parser state of
+// the connection, only the dispatch stage writes tail and the rest of it.
+struct pipeline {
+    struct protocol_conn *conn;
+    // Position the receive stage writes the next frame at. Positions run
+    // freely and are reduced modulo the ring size on access.
+    _Atomic uint32_t head;
+    uint8_t ring[PIPELINE_RING_SIZE];
+    // Position the dispatch stage reads the next frame from
+    _Atomic uint32_t tail;
+    // Where tail moves once the frame returned by pipeline_peek is released
+    uint32_t next_tail;
+    // A completed frame that did not fit in the ring yet. It stays in the
+    // receive buffer of the connection until the ring has room.
+    struct protocol_frame pending;
+    // Times the receive stage found the ring full
+    uint32_t stalls;
+};
+
+// Sets up a pipeline for a connection initialized with protocol_conn_init.
+void pipeline_init(struct pipeline *p, struct protocol_conn *conn);
+// Receive stage: parses bytes and moves completed frames, intact or not, into
+// the ring. Returns the number of bytes consumed, fewer than len when the
+// ring is full.
+size_t pipeline_receive(struct pipeline *p, const uint8_t *data, size_t len);
+// Dispatch stage: returns the oldest frame in the ring without removing it.
+// Returns false if the ring is empty.
+bool pipeline_peek(struct pipeline *p, struct protocol_frame *frame);
+// Dispatch stage: removes the frame returned by pipeline_peek.
+void pipeline_release(struct pipeline *p);
+// Dispatch stage: dispatches or acknowledges the oldest frame in the ring.
+// Returns false if the ring is empty.
+bool pipeline_dispatch(struct pipeline *p);
+// Runs the receive stage on the platform link forever.
+void pipeline_run_receiver(struct pipeline *p);
+// Runs the dispatch stage forever.
+void pipeline_run_dispatcher(struct pipeline *p);
+
+#endif
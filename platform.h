@@ -0,0 +1,39 @@
+#ifndef PLATFORM_H
+#define PLATFORM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Timeout value that makes platform_getc() block until a byte arrives.
+#define PLATFORM_WAIT_FOREVER UINT32_MAX
+// Returned by platform_getc() when no byte arrived in time.
+#define PLATFORM_TIMEOUT -1
+
+// Initializes the I/O channel and the status LED.
+void platform_init(void);
+// Reads one byte, waiting at most timeout_us microseconds.
+// Returns the byte, or PLATFORM_TIMEOUT if none arrived.
+int platform_getc(uint32_t timeout_us);
+// Writes a buffer to the link in a single transport write.
+// Returns the number of bytes written.
+int platform_write(const uint8_t *data, size_t len);
+// Returns a monotonic time in microseconds.
+uint64_t platform_time_us(void);
+// Starts the stopwatch used to time short stretches of code.
+void platform_stopwatch_start(void);
+// Returns the ticks since platform_stopwatch_start(), or UINT32_MAX if the
+// stopwatch ran out.
+uint32_t platform_stopwatch_ticks(void);
+// Returns the rate of the stopwatch in ticks per second.
+uint32_t platform_stopwatch_hz(void);
+// Turns the status LED on or off.
+void platform_set_led(bool on);
+// Gives up the processor until another core or thread calls
+// platform_signal_event(), or for a short while. Loops waiting on shared
+// state call it between checks.
+void platform_wait_event(void);
+// Wakes a core or thread waiting in platform_wait_event().
+void platform_signal_event(void);
+
+#endif
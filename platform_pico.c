@@ -0,0 +1,120 @@
+#include "platform.h"
+#include "hardware/clocks.h"
+#include "hardware/structs/systick.h"
+#include "hardware/sync.h"
+#include "pico/stdlib.h"
+#include <stdio.h>
+
+const int LED_PIN = 25;
+
+/**
+ * @brief Initializes standard I/O over USB and the LED pin.
+ *
+ * @return None.
+ *
+ * @note Newline translation is disabled so that a length byte of 0x0A is
+ *       not expanded into 0x0D 0x0A on the wire.
+ */
+void platform_init(void) {
+    // Initialize standard I/O
+    stdio_init_all();
+    // Set translation mode
+    stdio_set_translate_crlf(&stdio_usb, false);
+    // Initialize LED pin
+    gpio_init(LED_PIN);
+    // Set LED pin direction to output
+    gpio_set_dir(LED_PIN, GPIO_OUT);
+}
+
+/**
+ * @brief Reads one byte from USB serial.
+ *
+ * @param timeout_us Maximum time to wait, or PLATFORM_WAIT_FOREVER.
+ * @return The byte read, or PLATFORM_TIMEOUT.
+ */
+int platform_getc(uint32_t timeout_us) {
+    if (timeout_us == PLATFORM_WAIT_FOREVER) {
+        return getchar();
+    }
+    int c = getchar_timeout_us(timeout_us);
+    if (c == PICO_ERROR_TIMEOUT) {
+        return PLATFORM_TIMEOUT;
+    }
+    return c;
+}
+
+/**
+ * @brief Writes a buffer to USB serial.
+ *
+ * @param data Pointer to the bytes to send.
+ * @param len Number of bytes to send.
+ * @return The number of bytes written.
+ *
+ * @note The whole buffer is handed to the stdio driver at once, so the USB
+ *       stack can pack it into full 64 byte packets instead of sending one
+ *       packet per byte.
+ */
+int platform_write(const uint8_t *data, size_t len) {
+    size_t written = fwrite(data, 1, len, stdout);
+    fflush(stdout);
+    return written;
+}
+
+/**
+ * @brief Returns the time since boot in microseconds.
+ */
+uint64_t platform_time_us(void) { return time_us_64(); }
+
+/**
+ * @brief Starts the SysTick timer of the calling core from zero.
+ *
+ * @note SysTick counts processor clock cycles down from 0xFFFFFF, so it times
+ *       stretches of up to 2^24 cycles, about 130 ms at 125 MHz, exactly.
+ */
+void platform_stopwatch_start(void) {
+    systick_hw->csr = 0;
+    systick_hw->rvr = 0xFFFFFF;
+    // Any write clears the counter, which reloads on the next cycle
+    systick_hw->cvr = 0;
+    systick_hw->csr =
+        M0PLUS_SYST_CSR_CLKSOURCE_BITS | M0PLUS_SYST_CSR_ENABLE_BITS;
+}
+
+/**
+ * @brief Returns the processor cycles since platform_stopwatch_start().
+ *
+ * @return The cycles counted, or UINT32_MAX if SysTick wrapped around.
+ */
+uint32_t platform_stopwatch_ticks(void) {
+    uint32_t current = systick_hw->cvr;
+    if (systick_hw->csr & M0PLUS_SYST_CSR_COUNTFLAG_BITS) {
+        return UINT32_MAX;
+    }
+    return 0xFFFFFF - current;
+}
+
+/**
+ * @brief Returns the processor clock, which SysTick counts.
+ */
+uint32_t platform_stopwatch_hz(void) { return clock_get_hz(clk_sys); }
+
+/**
+ * @brief Turns the on-board LED on or off.
+ *
+ * @param on true to turn the LED on.
+ */
+void platform_set_led(bool on) { gpio_put(LED_PIN, on); }
+
+/**
+ * @brief Sleeps the calling core until an event arrives.
+ *
+ * @note A platform_signal_event() from the other core that came after the
+ *       last wait is remembered, so a wake-up is never lost between checking
+ *       the shared state and calling this.
+ */
+void platform_wait_event(void) { __wfe(); }
+
+/**
+ * @brief Sends an event that wakes the other core from platform_wait_event().
+ */
+void platform_signal_event(void) { __sev(); }
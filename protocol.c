@@ -1,12 +1,65 @@
 #include "protocol.h"
-#include "pico/stdlib.h"
+#include "bench.h"
+#include "platform.h"
 #include "tests.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
-const int LED_PIN = 25;
-int connected;
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// The link of the device itself, used by the functions that take no
+// connection
+struct protocol_conn protocol_default;
+
+// Largest chunk protocol_receive reads from the device link at once, one
+// USB full-speed packet
+#define RECEIVE_CHUNK 64
+
+// Bytes read from the device link that protocol_receive has not parsed yet
+static uint8_t receive_chunk[RECEIVE_CHUNK];
+static size_t receive_offset;
+static size_t receive_length;
+
+// Handlers for frame types registered by the application, shared by all
+// connections
+struct registered_type {
+    protocol_handler handler;
+    size_t payload_size;
+};
+static struct registered_type registered_types[256];
+
+/**
+ * @brief Builds a frame: header, payload, CRC and end marker.
+ *
+ * @param packet Buffer of at least payload_length + 7 bytes.
+ * @param type Frame type byte.
+ * @param payload Pointer to the payload. It may already be in place at
+ *        packet + 5.
+ * @param payload_length Length of the payload.
+ * @return The length of the frame.
+ */
+size_t protocol_encode_frame(uint8_t *packet, uint8_t type,
+                             const uint8_t *payload, size_t payload_length) {
+    size_t packet_length = payload_length + 7;
+    if (payload_length > 0) {
+        memmove(packet + 5, payload, payload_length);
+    }
+    packet[0] = 0xAA;
+    packet[1] = packet_length >> 8;
+    packet[2] = packet_length;
+    packet[3] = 2;
+    packet[4] = type;
+    // The CRC is computed with its own byte set to 0
+    packet[5 + payload_length] = 0;
+    packet[6 + payload_length] = 0xBB;
+    packet[5 + payload_length] = compute_crc(packet, packet_length);
+    return packet_length;
+}
 
 /**
  * @brief Computes CRC (Cyclic Redundancy Check) for a given data buffer.
@@ -46,20 +99,58 @@ uint8_t compute_crc(uint8_t *data, size_t len) {
  *
  * @note This function initializes the communication module, configures
  *       standard I/O, sets the direction of the LED pin, and initializes
- *       the connected variable.
+ *       the device link.
  */
 void protocol_init(void) {
-    // Initialize standard I/O
-    stdio_init_all();
-    // Set translation mode
-    stdio_set_translate_crlf(&stdio_usb, false);
-    // Initialize LED pin
-    gpio_init(LED_PIN);
-    // Set LED pin direction to output
-    gpio_set_dir(LED_PIN, GPIO_OUT);
+    // Initialize standard I/O and the LED pin
+    platform_init();
+    // Initialize the device link, which writes to the platform
+    protocol_conn_init(&protocol_default, NULL, NULL);
+}
+
+/**
+ * @brief Initializes the state of one link.
+ *
+ * @param conn The connection to initialize.
+ * @param write Function flushed output is written with, or NULL for
+ *        platform_write.
+ * @param io Passed to write.
+ *
+ * @note Does not touch the platform, so any number of connections can be
+ *       set up on a host. Handlers registered with protocol_register_handler
+ *       are shared by all connections and are left alone.
+ */
+void protocol_conn_init(struct protocol_conn *conn, protocol_write_fn write,
+                        void *io) {
     // Initialize connected variable
-    connected = 0;
+    conn->connected = 0;
+    // Start with an empty output buffer
+    conn->tx_length = 0;
+    conn->flush_deadline_us = PROTOCOL_FLUSH_DEADLINE_US;
+    conn->write = write;
+    conn->io = io;
+    // Nothing is known about the other side yet
+    memset(&conn->peer_caps, 0, sizeof(conn->peer_caps));
+    // Start looking for a start marker
+    conn->rx_length = 0;
+    conn->rx_skipping = false;
+    protocol_conn_reset_stats(conn);
+}
+
+/**
+ * @brief Marks a link connected and sends an open signal.
+ *
+ * @param conn The connection.
+ */
+static void conn_connect(struct protocol_conn *conn) {
+    // Set connected flag
+    conn->connected = 1;
+    // Send open signal
+    protocol_conn_send_open(conn);
+    // Turn on LED
+    platform_set_led(true);
 }
+
 /**
  * @brief Opens a connection for communication.
  *
@@ -69,15 +160,168 @@ void protocol_init(void) {
  *       and turns on the LED indicating a successful connection.
  */
 int protocol_connect() {
-    // Set connected flag
-    connected = 1;
-    // Send open signal
-    protocol_send_open();
-    // Turn on LED
-    gpio_put(LED_PIN, 1);
+    conn_connect(&protocol_default);
+    return 0;
+}
+
+/**
+ * @brief Marks a link disconnected and sends a close signal.
+ *
+ * @param conn The connection.
+ */
+static void conn_disconnect(struct protocol_conn *conn) {
+    // Update connection status
+    conn->connected = 0;
+    // Send close command
+    protocol_conn_send_typed(conn, 'c', NULL, 0);
+    // Turn off LED
+    platform_set_led(false);
+}
+
+/**
+ * @brief Writes bytes to the transport of a link.
+ */
+static int conn_transport_write(struct protocol_conn *conn,
+                                const uint8_t *data, size_t len) {
+    if (conn->write == NULL) {
+        return platform_write(data, len);
+    }
+    return conn->write(conn->io, data, len);
+}
+
+/**
+ * @brief Queues raw bytes in the output buffer.
+ *
+ * @param conn The connection.
+ * @param data Pointer to the bytes to send.
+ * @param len Number of bytes to send.
+ * @return The number of bytes queued or written.
+ *
+ * @note Consecutive frames are coalesced so that a burst of small frames
+ *       costs one transport write instead of one per frame. The buffer is
+ *       flushed when it fills up or when the flush deadline of its oldest
+ *       byte has passed. A frame is never split across two flushes unless it
+ *       is larger than the buffer, in which case it is written directly.
+ */
+int protocol_conn_write(struct protocol_conn *conn, const uint8_t *data,
+                        size_t len) {
+    // A zero deadline means no coalescing at all
+    if (conn->flush_deadline_us == 0) {
+        protocol_conn_flush(conn);
+        return conn_transport_write(conn, data, len);
+    }
+    // Make room for the frame so that it stays in one piece
+    if (conn->tx_length + len > PROTOCOL_TX_BUFFER_SIZE) {
+        protocol_conn_flush(conn);
+    }
+    if (len > PROTOCOL_TX_BUFFER_SIZE) {
+        return conn_transport_write(conn, data, len);
+    }
+
+    uint64_t now = platform_time_us();
+    // Start the deadline when the first byte enters an empty buffer
+    if (conn->tx_length == 0) {
+        if (conn->flush_deadline_us == PROTOCOL_NO_DEADLINE) {
+            conn->tx_deadline = UINT64_MAX;
+        } else {
+            conn->tx_deadline = now + conn->flush_deadline_us;
+        }
+    }
+    memcpy(conn->tx_buffer + conn->tx_length, data, len);
+    conn->tx_length += len;
+
+    if (conn->tx_length == PROTOCOL_TX_BUFFER_SIZE ||
+        now >= conn->tx_deadline) {
+        protocol_conn_flush(conn);
+    }
+    return len;
+}
+
+/**
+ * @brief Queues raw bytes in the output buffer of the device link.
+ */
+int protocol_write(const uint8_t *data, size_t len) {
+    return protocol_conn_write(&protocol_default, data, len);
+}
+
+/**
+ * @brief Sends all buffered output of a link to its transport.
+ *
+ * @param conn The connection.
+ * @return The number of bytes written.
+ */
+int protocol_conn_flush(struct protocol_conn *conn) {
+    if (conn->tx_length == 0) {
+        return 0;
+    }
+    int written = conn_transport_write(conn, conn->tx_buffer, conn->tx_length);
+    conn->tx_length = 0;
+    return written;
+}
+
+/**
+ * @brief Sends all buffered output of the device link to the transport.
+ */
+int protocol_flush() { return protocol_conn_flush(&protocol_default); }
+
+/**
+ * @brief Sets how long buffered output may wait before being flushed.
+ *
+ * @param conn The connection.
+ * @param deadline_us Deadline in microseconds, 0 to write every frame
+ *        straight through, or PROTOCOL_NO_DEADLINE to only flush explicitly,
+ *        on a full buffer, or when the receiver goes idle.
+ *
+ * @note Any pending output is flushed so the new deadline applies from the
+ *       next queued byte.
+ */
+void protocol_conn_set_flush_deadline(struct protocol_conn *conn,
+                                      uint32_t deadline_us) {
+    protocol_conn_flush(conn);
+    conn->flush_deadline_us = deadline_us;
+}
+
+/**
+ * @brief Sets the flush deadline of the device link.
+ */
+void protocol_set_flush_deadline(uint32_t deadline_us) {
+    protocol_conn_set_flush_deadline(&protocol_default, deadline_us);
+}
+
+/**
+ * @brief Returns the number of bytes waiting in the output buffer of a link.
+ */
+size_t protocol_conn_pending(const struct protocol_conn *conn) {
+    return conn->tx_length;
+}
+
+/**
+ * @brief Returns the number of bytes waiting in the output buffer.
+ */
+size_t protocol_pending() { return protocol_conn_pending(&protocol_default); }
+
+/**
+ * @brief Flushes buffered output whose deadline has passed.
+ *
+ * @param conn The connection.
+ * @return The number of bytes written.
+ *
+ * @note The deadline is only checked when the protocol is called. Code that
+ *       spends a long time away from protocol_receive should call this from
+ *       its loop to keep the latency bound.
+ */
+int protocol_conn_poll(struct protocol_conn *conn) {
+    if (conn->tx_length > 0 && platform_time_us() >= conn->tx_deadline) {
+        return protocol_conn_flush(conn);
+    }
     return 0;
 }
 
+/**
+ * @brief Flushes output of the device link whose deadline has passed.
+ */
+int protocol_poll() { return protocol_conn_poll(&protocol_default); }
+
 /**
  * @brief Sends data over an established connection.
  *
@@ -85,117 +329,192 @@ int protocol_connect() {
  * @param payload_length Length of the data payload.
  * @return The number of bytes sent.
  *
- * @note This function constructs a packet consisting of header, payload,
- *       and footer. It computes CRC for the packet and sends it over the
- *       established connection. For demonstration purposes, the packet is
- *       printed to standard output.
+ * @note The packet is built by protocol_encode_frame and queued in the
+ *       output buffer; it reaches the wire on the next flush.
  */
 int protocol_send(const uint8_t *payload, size_t payload_length) {
-    // Calculate the total packet length including payload, header, and footer
-    size_t packet_length = payload_length + 7;
-    // Create a buffer for the packet
-    uint8_t packet[packet_length];
-    // Header contains: start byte, packet length (high byte), packet length
-    // (low byte), protocol version, and command
-    uint8_t header[5] = {0xAA, packet_length >> 8, packet_length, 2, 'd'};
-    // Footer contains: CRC (to be filled later)
-    uint8_t footer[2] = {0, 0xBB};
-    // Copy header into the packet buffer
-    memcpy(packet, header, 5);
-    // Copy payload into the packet buffer
-    memcpy(packet + 5, payload, payload_length);
-    // Copy footer into the packet buffer
-    memcpy(packet + 5 + payload_length, footer, 2);
-
-    // Compute CRC for the packet
-    uint8_t crc = compute_crc(packet, packet_length);
-    // Insert computed CRC into the packet
-    packet[5 + payload_length] = crc;
-
-    // Send packet by iterating through each byte in the packet
-    for (size_t i = 0; i < packet_length; i++) {
-        putchar(packet[i]);
-    }
-    // Return the total packet length
-    return packet_length;
+    return protocol_conn_send_typed(&protocol_default, 'd', payload,
+                                    payload_length);
 }
 /**
  * @brief Sends an acknowledgment packet over the connection.
  *
+ * @param conn The connection.
  * @param err Error code to be included in the acknowledgment packet.
  * @return The number of bytes sent.
  *
- * @note This function constructs an acknowledgment packet with a header,
- *       error code payload, and footer. It computes CRC for the packet
- *       and sends it over the connection. For demonstration purposes,
- *       the packet is printed to standard output.
+ * @note The error code is the one byte payload of an 'a' frame, which is
+ *       queued in the output buffer.
+ */
+int protocol_conn_send_ack(struct protocol_conn *conn, int err) {
+    uint8_t code = err;
+    return protocol_conn_send_typed(conn, 'a', &code, 1);
+}
+
+/**
+ * @brief Sends an acknowledgment packet over the device link.
  */
 int protocol_send_ack(int err) {
-    // Calculate the total packet length including header and footer
-    size_t packet_length = 1 + 7;
-    // Create a buffer for the packet
-    uint8_t packet[packet_length];
-    // Header contains: start byte, packet length (high byte), packet length
-    // (low byte), protocol version, and command
-    uint8_t header[5] = {0xAA, packet_length >> 8, packet_length, 2, 'a'};
-    // Footer contains: CRC (to be filled later)
-    uint8_t footer[2] = {0, 0xBB};
-    // Copy header into the packet buffer
-    memcpy(packet, header, 5);
-    // Insert error code into the packet
-    packet[5] = err;
-    // Copy footer into the packet buffer
-    memcpy(packet + 5 + 1, footer, 2);
-
-    // Compute CRC for the packet
-    uint8_t crc = compute_crc(packet, packet_length);
-    // Insert computed CRC into the packet
-    packet[5 + 1] = crc;
-
-    // Send packet by iterating through each byte in the packet
-    for (size_t i = 0; i < packet_length; i++) {
-        putchar(packet[i]);
-    }
-    // Return the total packet length
-    return packet_length;
+    return protocol_conn_send_ack(&protocol_default, err);
+}
+
+/**
+ * @brief Sends an open frame carrying our capability block.
+ *
+ * @param conn The connection.
+ * @param flags PROTOCOL_CAPS_REPLY when answering the other side's open.
+ * @return The number of bytes sent.
+ *
+ * @note The block is laid out as flags, lowest and highest supported
+ *       version, maximum frame size (2 bytes, high byte first), receive
+ *       buffer count, and the supported checksum, compression and framing
+ *       options.
+ */
+static int send_open(struct protocol_conn *conn, uint8_t flags) {
+    uint8_t caps[PROTOCOL_CAPS_SIZE] = {
+        flags,
+        PROTOCOL_VERSION_MIN,
+        PROTOCOL_VERSION_MAX,
+        PROTOCOL_MAX_FRAME_SIZE >> 8,
+        PROTOCOL_MAX_FRAME_SIZE & 0xFF,
+        PROTOCOL_RX_BUFFERS,
+        PROTOCOL_CHECKSUM_CRC8,
+        PROTOCOL_COMPRESSION_NONE,
+        PROTOCOL_FRAMING_MARKERS,
+    };
+    return protocol_conn_send_typed(conn, 'o', caps, PROTOCOL_CAPS_SIZE);
 }
 
 /**
  * @brief Sends an open signal over the connection.
  *
+ * @param conn The connection.
  * @return The number of bytes sent.
  *
- * @note This function constructs a packet with a header indicating an open
- *       signal and a footer. It computes CRC for the packet and sends it
- *       over the connection. For demonstration purposes, the packet is
- *       printed to standard output.
+ * @note The open frame carries our capability block so the other side can
+ *       pick a frame size we can receive. Peers that do not negotiate send
+ *       an empty open frame instead, which is still accepted.
  */
-int protocol_send_open() {
-    // Calculate the total packet length including header and footer
-    size_t packet_length = 7;
-    // Create a buffer for the packet
-    uint8_t packet[packet_length];
-    // Header contains: start byte, packet length (high byte), packet length
-    // (low byte), protocol version, and command
-    uint8_t header[5] = {0xAA, packet_length >> 8, packet_length, 2, 'o'};
-    // Footer contains: CRC (to be filled later)
-    uint8_t footer[2] = {0, 0xBB};
-    // Copy header into the packet buffer
-    memcpy(packet, header, 5);
-    // Copy footer into the packet buffer
-    memcpy(packet + 5, footer, 2);
-
-    // Compute CRC for the packet
-    uint8_t crc = compute_crc(packet, packet_length);
-    // Insert computed CRC into the packet
-    packet[5] = crc;
-
-    // Send packet by iterating through each byte in the packet
-    for (size_t i = 0; i < packet_length; i++) {
-        putchar(packet[i]);
+int protocol_conn_send_open(struct protocol_conn *conn) {
+    return send_open(conn, 0);
+}
+
+/**
+ * @brief Sends an open signal over the device link.
+ */
+int protocol_send_open() { return protocol_conn_send_open(&protocol_default); }
+
+/**
+ * @brief Returns the capabilities announced by the other side of a link.
+ *
+ * @param conn The connection.
+ * @return Pointer to the capabilities, all zero if none were received.
+ */
+const struct protocol_caps *
+protocol_conn_peer_caps(const struct protocol_conn *conn) {
+    return &conn->peer_caps;
+}
+
+/**
+ * @brief Returns the capabilities announced by the other side.
+ */
+const struct protocol_caps *protocol_peer_caps() {
+    return protocol_conn_peer_caps(&protocol_default);
+}
+
+/**
+ * @brief Returns the largest frame size both sides of a link accept.
+ *
+ * @param conn The connection.
+ * @return The smaller of our and the other side's maximum frame size, or our
+ *         own if the other side did not announce a usable one.
+ */
+size_t protocol_conn_frame_size(const struct protocol_conn *conn) {
+    if (conn->peer_caps.max_frame_size >= PROTOCOL_MIN_FRAME_SIZE &&
+        conn->peer_caps.max_frame_size < PROTOCOL_MAX_FRAME_SIZE) {
+        return conn->peer_caps.max_frame_size;
+    }
+    return PROTOCOL_MAX_FRAME_SIZE;
+}
+
+/**
+ * @brief Returns the largest frame size both sides of the device link
+ *        accept.
+ */
+size_t protocol_frame_size() {
+    return protocol_conn_frame_size(&protocol_default);
+}
+
+/**
+ * @brief Decodes the capability block of an open frame.
+ *
+ * @param payload Pointer to the payload of the frame.
+ * @param payload_length Length of the payload.
+ * @param caps Set to the capabilities.
+ * @return false if the payload is too short for a capability block or the
+ *         two sides have no version in common.
+ *
+ * @note A frame size too small for any payload is set to 0, as if it had not
+ *       been announced.
+ */
+bool protocol_decode_caps(const uint8_t *payload, size_t payload_length,
+                          struct protocol_caps *caps) {
+    if (payload_length < PROTOCOL_CAPS_SIZE) {
+        return false;
+    }
+    caps->flags = payload[0];
+    caps->version_min = payload[1];
+    caps->version_max = payload[2];
+    caps->max_frame_size = payload[3] << 8 | payload[4];
+    caps->rx_buffers = payload[5];
+    caps->checksums = payload[6];
+    caps->compression = payload[7];
+    caps->framing = payload[8];
+    if (caps->max_frame_size < PROTOCOL_MIN_FRAME_SIZE) {
+        caps->max_frame_size = 0;
+    }
+    // There has to be a version both sides speak
+    return caps->version_max >= PROTOCOL_VERSION_MIN &&
+           caps->version_min <= PROTOCOL_VERSION_MAX;
+}
+
+/**
+ * @brief Handles an open frame.
+ *
+ * @param conn The connection the frame arrived on.
+ * @param payload Pointer to the payload of the frame.
+ * @param payload_length Length of the payload.
+ *
+ * @note An open request is answered with our own capabilities, even when
+ *       already connected, so the other side can renegotiate after a
+ *       restart. A reply to our own request is never answered, which keeps
+ *       the two sides from bouncing open frames back and forth.
+ */
+static void handle_open(struct protocol_conn *conn, const uint8_t *payload,
+                        size_t payload_length) {
+    // An empty open comes from a peer that does not negotiate
+    if (payload_length < PROTOCOL_CAPS_SIZE) {
+        if (conn->connected == 1) {
+            protocol_conn_send_ack(conn, OPENED);
+        } else {
+            conn_connect(conn);
+        }
+        return;
+    }
+
+    struct protocol_caps caps;
+    if (!protocol_decode_caps(payload, payload_length, &caps)) {
+        protocol_conn_send_ack(conn, VERSION);
+        printf("no common version\n");
+        return;
+    }
+    conn->peer_caps = caps;
+
+    conn->connected = 1;
+    platform_set_led(true);
+    if (!(caps.flags & PROTOCOL_CAPS_REPLY)) {
+        send_open(conn, PROTOCOL_CAPS_REPLY);
     }
-    // Return the total packet length
-    return packet_length;
 }
 
 /**
@@ -203,37 +522,10 @@ int protocol_send_open() {
  *
  * @return The number of bytes sent.
  *
- * @note This function constructs a packet with a header indicating a close
- *       signal and a footer. It computes CRC for the packet and sends it
- *       over the connection. For demonstration purposes, the packet is
- *       printed to standard output.
+ * @note The 'c' frame has no payload and is queued in the output buffer.
  */
 int protocol_send_close() {
-    // Calculate the total packet length including header and footer
-    size_t packet_length = 7;
-    // Create a buffer for the packet
-    uint8_t packet[packet_length];
-    // Header contains: start byte, packet length (high byte), packet length
-    // (low byte), protocol version, and command
-    uint8_t header[5] = {0xAA, packet_length >> 8, packet_length, 2, 'c'};
-    // Footer contains: CRC (to be filled later)
-    uint8_t footer[2] = {0, 0xBB};
-    // Copy header into the packet buffer
-    memcpy(packet, header, 5);
-    // Copy footer into the packet buffer
-    memcpy(packet + 5, footer, 2);
-
-    // Compute CRC for the packet
-    uint8_t crc = compute_crc(packet, packet_length);
-    // Insert computed CRC into the packet
-    packet[5] = crc;
-
-    // Send packet by iterating through each byte in the packet
-    for (size_t i = 0; i < packet_length; i++) {
-        putchar(packet[i]);
-    }
-    // Return the total packet length
-    return packet_length;
+    return protocol_conn_send_typed(&protocol_default, 'c', NULL, 0);
 }
 
 /**
@@ -243,108 +535,360 @@ int protocol_send_close() {
  * @param payload_length Length of the data payload.
  * @return The number of bytes sent.
  *
- * @note This function constructs a packet with a header indicating an echo
- *       operation, payload data, and a footer. It computes CRC for the packet
- *       and sends it over the connection. For demonstration purposes, the
- *       packet is printed to standard output.
+ * @note The 'e' frame is queued in the output buffer.
  */
 int protocol_send_echo(const uint8_t *payload, size_t payload_length) {
-    // Calculate the total packet length including payload, header, and footer
-    size_t packet_length = payload_length + 7;
+    return protocol_conn_send_typed(&protocol_default, 'e', payload,
+                                    payload_length);
+}
+
+/**
+ * @brief Sends a frame of a registered type over the connection.
+ *
+ * @param conn The connection.
+ * @param type Frame type byte.
+ * @param payload Pointer to the payload.
+ * @param payload_length Length of the payload.
+ * @return The number of bytes sent.
+ *
+ * @note Every frame the protocol sends is built here, by
+ *       protocol_encode_frame, and queued in the output buffer.
+ */
+int protocol_conn_send_typed(struct protocol_conn *conn, uint8_t type,
+                             const uint8_t *payload, size_t payload_length) {
     // Create a buffer for the packet
-    uint8_t packet[packet_length];
-    // Header contains: start byte, packet length (high byte), packet length
-    // (low byte), protocol version, and command
-    uint8_t header[5] = {0xAA, packet_length >> 8, packet_length, 2, 'e'};
-    // Footer contains: CRC (to be filled later)
-    uint8_t footer[2] = {0, 0xBB};
-    // Copy header into the packet buffer
-    memcpy(packet, header, 5);
-    // Copy payload into the packet buffer
-    memcpy(packet + 5, payload, payload_length);
-    // Copy footer into the packet buffer
-    memcpy(packet + 5 + payload_length, footer, 2);
-
-    // Compute CRC for the packet
-    uint8_t crc = compute_crc(packet, packet_length);
-    // Insert computed CRC into the packet
-    packet[5 + payload_length] = crc;
-
-    // Send packet by iterating through each byte in the packet
-    for (size_t i = 0; i < packet_length; i++) {
-        putchar(packet[i]);
-    }
+    uint8_t packet[payload_length + 7];
+    size_t packet_length =
+        protocol_encode_frame(packet, type, payload, payload_length);
+
+    // Queue packet in the output buffer
+    protocol_conn_write(conn, packet, packet_length);
     // Return the total packet length
     return packet_length;
 }
 
 /**
- * @brief Receives data from an established connection.
+ * @brief Sends a frame of a registered type over the device link.
+ */
+int protocol_send_typed(uint8_t type, const uint8_t *payload,
+                        size_t payload_length) {
+    return protocol_conn_send_typed(&protocol_default, type, payload,
+                                    payload_length);
+}
+
+/**
+ * @brief Registers the handler for an application frame type.
  *
- * @return The number of bytes received.
+ * @param type Frame type byte.
+ * @param payload_size Exact payload length frames of this type must have,
+ *        or PROTOCOL_ANY_SIZE.
+ * @param handler Function called with the payload of each frame, or NULL to
+ *        remove the handler.
+ * @return 0 on success, -1 if the type is handled by the protocol itself.
  *
- * @note This function receives a packet from the established connection,
- *       verifies its integrity, processes the packet based on its type, and
- *       takes appropriate actions. It handles acknowledgments, data packets,
- *       open/close signals, echo requests, and test commands. For each received
- *       packet, it sends acknowledgments if necessary and prints relevant
- * messages.
+ * @note Frames whose payload length does not match are answered with a
+ *       LENGTH acknowledgement and not passed to the handler.
  */
-int protocol_receive() {
-    // Wait for the start marker
-    uint8_t start_marker;
-    do {
-        start_marker = getchar();
-    } while (start_marker != 0xAA);
-
-    // Read packet length
-    uint16_t packet_length = getchar() << 8;
-    packet_length += getchar();
+int protocol_register_handler(uint8_t type, size_t payload_size,
+                              protocol_handler handler) {
+    // schemagen.py keeps the same list as RESERVED_TYPES
+    switch (type) {
+    case 'a':
+    case 'd':
+    case 'o':
+    case 'c':
+    case 'e':
+    case 't':
+    case 'b':
+        return -1;
+    }
+    registered_types[type].handler = handler;
+    registered_types[type].payload_size = payload_size;
+    return 0;
+}
 
-    // Create a buffer for the packet
-    uint8_t packet[packet_length];
-    packet[0] = start_marker;
-    packet[1] = packet_length >> 8; // Fixed typo: changed << to >>
-    packet[2] = packet_length;
-    packet[3] = getchar();
+/**
+ * @brief Returns the handler registered for a frame type.
+ *
+ * @param type Frame type byte.
+ * @return The handler, or NULL if none is registered.
+ */
+protocol_handler protocol_get_handler(uint8_t type) {
+    return registered_types[type].handler;
+}
 
-    // Check protocol version
-    if (packet[3] != 2) {
-        protocol_send_ack(VERSION);
-        printf("wrong version\n");
+/**
+ * @brief Reads one byte for the receive path.
+ *
+ * @return The byte read.
+ *
+ * @note While output is buffered the wait for input is bounded by the flush
+ *       deadline, and the buffer is flushed once it expires. Without a
+ *       deadline the buffer is flushed as soon as no input is ready, since the
+ *       other side may be waiting for our reply before it sends anything.
+ */
+static uint8_t receive_byte() {
+    struct protocol_conn *conn = &protocol_default;
+    if (conn->tx_length > 0) {
+        uint32_t wait = 0;
+        uint64_t now = platform_time_us();
+        if (conn->flush_deadline_us != PROTOCOL_NO_DEADLINE &&
+            conn->tx_deadline > now) {
+            wait = conn->tx_deadline - now;
+        }
+        int c = platform_getc(wait);
+        if (c != PLATFORM_TIMEOUT) {
+            return c;
+        }
+        protocol_flush();
     }
+    return platform_getc(PLATFORM_WAIT_FOREVER);
+}
 
-    packet[4] = getchar();
+/**
+ * @brief Finds the first start marker in a buffer.
+ *
+ * @param data Pointer to the bytes to search.
+ * @param len Number of bytes.
+ * @return The offset of the first 0xAA, or len if there is none.
+ *
+ * @note Compares 16 bytes per step with SSE2 or NEON, and a word per step
+ *       elsewhere, which includes the Cortex-M0+ of the RP2040.
+ */
+size_t protocol_find_start(const uint8_t *data, size_t len) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i marker = _mm_set1_epi8((char)0xAA);
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, marker));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__ARM_NEON)
+    const uint8x16_t marker = vdupq_n_u8(0xAA);
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t equal = vceqq_u8(vld1q_u8(data + i), marker);
+        // Narrow each byte of the comparison to 4 bits of a 64 bit mask
+        uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(equal), 4);
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+        if (mask != 0) {
+            return i + (__builtin_ctzll(mask) >> 2);
+        }
+    }
+#else
+    // Step up to a word boundary, since the M0+ cannot load unaligned words
+    for (; i < len && ((uintptr_t)(data + i) & 3) != 0; i++) {
+        if (data[i] == 0xAA) {
+            return i;
+        }
+    }
+    for (; i + 4 <= len; i += 4) {
+        uint32_t word;
+        memcpy(&word, data + i, 4);
+        // A byte of x is zero exactly where the word holds a marker
+        uint32_t x = word ^ 0xAAAAAAAAu;
+        if (((x - 0x01010101u) & ~x & 0x80808080u) != 0) {
+            break;
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        if (data[i] == 0xAA) {
+            return i;
+        }
+    }
+    return len;
+}
 
-    // Read payload
-    for (int i = 0; i < packet_length - 7; i++) {
-        packet[5 + i] = getchar();
+/**
+ * @brief Counts bytes skipped while looking for a start marker.
+ *
+ * @param conn The connection.
+ * @param n Number of bytes skipped.
+ */
+static void skip_junk(struct protocol_conn *conn, size_t n) {
+    // Count each run of junk once as a resync
+    if (!conn->rx_skipping) {
+        conn->rx_skipping = true;
+        conn->stats.resyncs++;
     }
+    conn->stats.bytes_skipped += n;
+}
 
-    // Read received CRC
-    uint8_t received_crc = getchar();
+/**
+ * @brief Feeds received bytes to the frame parser of a link.
+ *
+ * @param conn The connection the bytes arrived on.
+ * @param data Pointer to the received bytes.
+ * @param len Number of bytes available.
+ * @param frame Set to the frame that was completed, if any.
+ * @return The number of bytes consumed.
+ *
+ * @note The parser keeps its state between calls, so bytes can arrive one at
+ *       a time or in chunks of any size. It stops right after the first frame
+ *       it completes, leaving the rest of the chunk for the next call. A
+ *       completed frame has a non-zero length; its error field tells whether
+ *       it passed the length, version, end marker and CRC checks. The frame
+ *       stays valid until the next call. Bytes before a start marker are
+ *       skipped in bulk and counted in the statistics. The length and
+ *       version are checked as soon as they arrive, so that a stray 0xAA
+ *       does not swallow the frame after it: the marker is rejected after 3
+ *       or 4 bytes and counted as a stray marker rather than a frame error.
+ *       Every check only looks at bytes already received, so the result
+ *       does not depend on how the input is split into chunks.
+ */
+size_t protocol_conn_parse(struct protocol_conn *conn, const uint8_t *data,
+                           size_t len, struct protocol_frame *frame) {
+    frame->packet = conn->rx_buffer;
+    frame->length = 0;
+    frame->error = NO_ERROR;
+
+    size_t i = 0;
+    while (i < len) {
+        // Wait for the start marker, skipping everything before it at once
+        if (conn->rx_length == 0) {
+            size_t start = i + protocol_find_start(data + i, len - i);
+            if (start > i) {
+                skip_junk(conn, start - i);
+                i = start;
+            }
+            if (i == len) {
+                break;
+            }
+            conn->rx_skipping = false;
+            conn->rx_buffer[conn->rx_length++] = data[i++];
+            continue;
+        }
+
+        // Read packet length and protocol version
+        if (conn->rx_length < 4) {
+            conn->rx_buffer[conn->rx_length++] = data[i++];
+            // Reject lengths that cannot be a frame or do not fit the buffer,
+            // and look for the next start marker
+            if (conn->rx_length == 3) {
+                conn->rx_expected =
+                    conn->rx_buffer[1] << 8 | conn->rx_buffer[2];
+                if (conn->rx_expected < 7 ||
+                    conn->rx_expected > PROTOCOL_MAX_FRAME_SIZE) {
+                    frame->length = conn->rx_length;
+                    frame->error = LENGTH;
+                    break;
+                }
+            }
+            // Likewise for a version we do not speak
+            if (conn->rx_length == 4 && conn->rx_buffer[3] != 2) {
+                frame->length = conn->rx_length;
+                frame->error = VERSION;
+                break;
+            }
+            continue;
+        }
+
+        // Copy as much of the rest of the packet as is available
+        size_t n = conn->rx_expected - conn->rx_length;
+        if (n > len - i) {
+            n = len - i;
+        }
+        memcpy(conn->rx_buffer + conn->rx_length, data + i, n);
+        conn->rx_length += n;
+        i += n;
+        if (conn->rx_length < conn->rx_expected) {
+            continue;
+        }
 
-    // Prepare packet for CRC computation
-    packet[packet_length - 2] = 0;
-    packet[packet_length - 1] = 0xBB;
+        uint8_t *packet = conn->rx_buffer;
+        size_t packet_length = conn->rx_expected;
+        frame->length = packet_length;
 
-    // Compute CRC
-    uint8_t computed_crc = compute_crc(packet, packet_length);
+        // Check end marker
+        uint8_t end_marker = packet[packet_length - 1];
+        uint8_t received_crc = packet[packet_length - 2];
+        if (end_marker != 0xBB) {
+            frame->error = ENDING;
+            break;
+        }
 
-    // Compare received CRC with computed CRC
-    if (received_crc != computed_crc) {
-        protocol_send_ack(CRC);
-        printf("incorrect crc: got %d , expected %d\n", received_crc,
-               computed_crc);
+        // Compute CRC with the CRC field cleared, then restore it
+        packet[packet_length - 2] = 0;
+        uint8_t computed_crc = compute_crc(packet, packet_length);
+        packet[packet_length - 2] = received_crc;
+        if (received_crc != computed_crc) {
+            frame->error = CRC;
+        }
+        break;
     }
 
-    // Check end marker
-    packet[packet_length - 1] = getchar();
-    if (packet[packet_length - 1] != 0xBB) {
-        protocol_send_ack(ENDING);
-        printf("not the last bit %d\n", packet[packet_length - 1]);
+    conn->stats.bytes += i;
+    if (frame->length > 0) {
+        conn->rx_length = 0;
+        if (frame->error == NO_ERROR) {
+            conn->stats.frames++;
+        } else if (frame->length <= 4) {
+            // Rejected by its header alone, most likely 0xAA in noise
+            conn->stats.stray_markers++;
+        } else {
+            conn->stats.errors[frame->error]++;
+        }
     }
+    return i;
+}
+
+/**
+ * @brief Feeds received bytes to the frame parser of the device link.
+ */
+size_t protocol_parse(const uint8_t *data, size_t len,
+                      struct protocol_frame *frame) {
+    return protocol_conn_parse(&protocol_default, data, len, frame);
+}
 
+/**
+ * @brief Acknowledges a bad frame or dispatches a good one.
+ *
+ * @param conn The connection the frame arrived on.
+ * @param frame A frame completed by protocol_conn_parse.
+ */
+void protocol_conn_handle_frame(struct protocol_conn *conn,
+                                const struct protocol_frame *frame) {
+    const uint8_t *packet = frame->packet;
+    switch (frame->error) {
+    case NO_ERROR:
+        protocol_conn_dispatch(conn, packet, frame->length);
+        break;
+    case LENGTH:
+        protocol_conn_send_ack(conn, LENGTH);
+        printf("wrong length %d\n", packet[1] << 8 | packet[2]);
+        break;
+    case ENDING:
+        protocol_conn_send_ack(conn, ENDING);
+        printf("not the last bit %d\n", packet[frame->length - 1]);
+        break;
+    case VERSION:
+        protocol_conn_send_ack(conn, VERSION);
+        printf("wrong version\n");
+        break;
+    case CRC:
+        protocol_conn_send_ack(conn, CRC);
+        printf("incorrect crc: got %d\n", packet[frame->length - 2]);
+        break;
+    }
+}
+
+/**
+ * @brief Processes a received frame based on its type.
+ *
+ * @param conn The connection the frame arrived on.
+ * @param packet Pointer to the whole frame, start marker to end marker.
+ * @param packet_length Length of the frame.
+ *
+ * @note This function handles acknowledgments, data packets, open/close
+ *       signals, echo requests, test and benchmark commands, and frame types
+ *       registered with protocol_register_handler. It sends acknowledgments
+ *       if necessary and prints relevant messages.
+ */
+void protocol_conn_dispatch(struct protocol_conn *conn, const uint8_t *packet,
+                            size_t packet_length) {
     // Process packet based on command type
     switch (packet[4]) {
     case 'a':
@@ -355,44 +899,163 @@ int protocol_receive() {
         }
         break;
     case 'd':
-        for (int i = 0; i < packet_length - 7; i++) {
+        for (size_t i = 0; i < packet_length - 7; i++) {
             printf("%c", packet[i + 5]);
         }
         printf("\n");
         break;
     case 'o':
-        if (connected == 1) {
-            protocol_send_ack(OPENED);
-        } else {
-            protocol_connect();
-        }
+        handle_open(conn, packet + 5, packet_length - 7);
         break;
     case 'c':
-        if (connected == 1) {
-            protocol_disconnect();
+        if (conn->connected == 1) {
+            conn_disconnect(conn);
         } else {
-            protocol_send_ack(CLOSED);
+            protocol_conn_send_ack(conn, CLOSED);
         }
         break;
-    case 'e': {
-        // Extract payload
-        uint8_t payload[packet_length - 7];
-        for (int i = 0; i < packet_length - 7; i++) {
-            payload[i] = packet[i + 5];
-        }
-        protocol_send(payload, packet_length - 7);
+    case 'e':
+        // Send the payload back as data
+        protocol_conn_send_typed(conn, 'd', packet + 5, packet_length - 7);
         break;
-    }
     case 't':
+#ifdef PROTOCOL_PIPELINE
+        // The tests read the link themselves, which core 0 owns here
+        protocol_conn_send_ack(conn, TYPE);
+#else
         run_tests();
+#endif
+        break;
+    case 'b':
+        run_benchmarks(conn, packet + 5, packet_length - 7);
         break;
-    default:
-        protocol_send_ack(TYPE);
-        printf("wrong\n");
+    default: {
+        struct registered_type *registered = &registered_types[packet[4]];
+        if (registered->handler == NULL) {
+            protocol_conn_send_ack(conn, TYPE);
+            printf("wrong\n");
+        } else if (registered->payload_size != PROTOCOL_ANY_SIZE &&
+                   registered->payload_size != packet_length - 7) {
+            protocol_conn_send_ack(conn, LENGTH);
+            printf("wrong length %zu for type %d\n", packet_length - 7,
+                   packet[4]);
+        } else {
+            // Hand over the payload in place, without copying it
+            registered->handler(packet + 5, packet_length - 7);
+        }
     }
-    return packet_length;
+    }
+}
+
+/**
+ * @brief Processes a frame received on the device link.
+ */
+void protocol_dispatch(const uint8_t *packet, size_t packet_length) {
+    protocol_conn_dispatch(&protocol_default, packet, packet_length);
+}
+
+/**
+ * @brief Receives data from an established connection.
+ *
+ * @return The number of bytes received.
+ *
+ * @note This function reads bytes until the parser completes a packet, then
+ *       dispatches it if it is intact or acknowledges the error otherwise.
+ *       Bytes read past the end of the packet are kept for the next call.
+ */
+int protocol_receive() {
+    struct protocol_frame frame;
+    do {
+        // Wait for one byte, then take whatever else is ready, so the parser
+        // sees chunks and skips junk a word at a time
+        if (receive_offset == receive_length) {
+            receive_chunk[0] = receive_byte();
+            receive_offset = 0;
+            receive_length = 1;
+            int c;
+            while (receive_length < RECEIVE_CHUNK &&
+                   (c = platform_getc(0)) != PLATFORM_TIMEOUT) {
+                receive_chunk[receive_length++] = c;
+            }
+        }
+        receive_offset +=
+            protocol_parse(receive_chunk + receive_offset,
+                           receive_length - receive_offset, &frame);
+    } while (frame.length == 0);
+
+    protocol_conn_handle_frame(&protocol_default, &frame);
+    return frame.length;
 }
 
+/**
+ * @brief Drops bytes read from the device link but not parsed yet.
+ *
+ * @note For code that reads the link with platform_getc itself and must not
+ *       see a leftover of an earlier protocol_receive afterwards.
+ */
+void protocol_discard_input() { receive_offset = receive_length; }
+
+/**
+ * @brief Handles a chunk of bytes received on a link.
+ *
+ * @param conn The connection the bytes arrived on.
+ * @param data Pointer to the received bytes.
+ * @param len Number of bytes.
+ * @return The number of frames completed, intact or not.
+ *
+ * @note Frames may span several chunks. Each completed frame is dispatched
+ *       or acknowledged as in protocol_receive.
+ */
+int protocol_conn_receive_bytes(struct protocol_conn *conn,
+                                const uint8_t *data, size_t len) {
+    int frames = 0;
+    while (len > 0) {
+        struct protocol_frame frame;
+        size_t n = protocol_conn_parse(conn, data, len, &frame);
+        data += n;
+        len -= n;
+        if (frame.length > 0) {
+            protocol_conn_handle_frame(conn, &frame);
+            frames++;
+        }
+    }
+    return frames;
+}
+
+/**
+ * @brief Handles a chunk of bytes received on the device link.
+ */
+int protocol_receive_bytes(const uint8_t *data, size_t len) {
+    return protocol_conn_receive_bytes(&protocol_default, data, len);
+}
+
+/**
+ * @brief Returns the receive statistics of a link.
+ */
+const struct protocol_stats *
+protocol_conn_get_stats(const struct protocol_conn *conn) {
+    return &conn->stats;
+}
+
+/**
+ * @brief Returns the receive statistics.
+ */
+const struct protocol_stats *protocol_get_stats() {
+    return protocol_conn_get_stats(&protocol_default);
+}
+
+/**
+ * @brief Clears the receive statistics of a link.
+ */
+void protocol_conn_reset_stats(struct protocol_conn *conn) {
+    memset(&conn->stats, 0, sizeof(conn->stats));
+}
+
+/**
+ * @brief Clears the receive statistics.
+ */
+void protocol_reset_stats() { protocol_conn_reset_stats(&protocol_default); }
+
 /**
  * @brief Closes the connection.
  *
@@ -401,11 +1064,4 @@ int protocol_receive() {
  * @note This function updates the connected flag, sends a close signal,
  *       turns off the LED, and performs any other necessary cleanup.
  */
-void protocol_disconnect() {
-    // Update connection status
-    connected = 0;
-    // Send close command
-    protocol_send_close();
-    // Turn off LED
-    gpio_put(LED_PIN, 0);
-}
+void protocol_disconnect() { conn_disconnect(&protocol_default); }
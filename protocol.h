@@ -1,11 +1,73 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
-#include "pico/stdlib.h"
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
+// Size of the output buffer used to coalesce outgoing frames.
+#ifndef PROTOCOL_TX_BUFFER_SIZE
+#define PROTOCOL_TX_BUFFER_SIZE 512
+#endif
+
+// Default time a buffered byte may wait before it is flushed.
+#ifndef PROTOCOL_FLUSH_DEADLINE_US
+#define PROTOCOL_FLUSH_DEADLINE_US 1000
+#endif
+
+// Flush deadline that disables the timer, leaving only explicit, full-buffer
+// and idle flushes.
+#define PROTOCOL_NO_DEADLINE UINT32_MAX
+
+// Protocol versions this implementation can speak.
+#define PROTOCOL_VERSION_MIN 2
+#define PROTOCOL_VERSION_MAX 2
+
+// Largest frame, header and footer included, the receive buffer can hold.
+// schemagen.py has its own copy as MAX_FRAME_SIZE; keep the two in sync.
+#ifndef PROTOCOL_MAX_FRAME_SIZE
+#define PROTOCOL_MAX_FRAME_SIZE 1024
+#endif
+
+// Smallest frame that can carry a payload: header, one byte and footer. A
+// smaller maximum frame size announced by the other side is ignored.
+#define PROTOCOL_MIN_FRAME_SIZE 8
+
+// Number of frames that can be received before one has to be handled. The
+// receive pipeline holds at least one frame in its ring and one more in the
+// receive buffer of the connection.
+#ifndef PROTOCOL_RX_BUFFERS
+#ifdef PROTOCOL_PIPELINE
+#define PROTOCOL_RX_BUFFERS 2
+#else
+#define PROTOCOL_RX_BUFFERS 1
+#endif
+#endif
+
+// Capability bits. Each field of the capability block is a set of options
+// the sender supports.
+#define PROTOCOL_CAPS_REPLY 0x01       // flags: answers an open request
+#define PROTOCOL_CHECKSUM_CRC8 0x01    // checksums: CRC-8, polynomial 0x07
+#define PROTOCOL_COMPRESSION_NONE 0x01 // compression: uncompressed payloads
+#define PROTOCOL_FRAMING_MARKERS 0x01  // framing: 0xAA/0xBB start and end
+
+// Size of the capability block carried by 'o' frames.
+#define PROTOCOL_CAPS_SIZE 9
+
+// What one side of the link supports, exchanged in the 'o' frame.
+struct protocol_caps {
+    uint8_t flags;
+    uint8_t version_min;
+    uint8_t version_max;
+    uint16_t max_frame_size;
+    uint8_t rx_buffers;
+    uint8_t checksums;
+    uint8_t compression;
+    uint8_t framing;
+};
+
 enum errors {
     NO_ERROR = 0,
     CRC = 1,
@@ -14,9 +76,87 @@ enum errors {
     TYPE = 4,
     OPENED = 5,
     CLOSED = 6,
+    LENGTH = 7,
+};
+
+// Number of codes in enum errors.
+#define PROTOCOL_ERROR_COUNT 8
+
+// A frame delimited by the receive parser.
+struct protocol_frame {
+    // The whole frame, start marker to end marker
+    const uint8_t *packet;
+    // Length of the frame, 0 if no frame was completed
+    size_t length;
+    // NO_ERROR, or why the frame was rejected (LENGTH, VERSION, ENDING, CRC)
+    int error;
+};
+
+// Counters kept by the receive parser.
+struct protocol_stats {
+    // Bytes fed to the parser
+    uint64_t bytes;
+    // Frames that passed every check
+    uint32_t frames;
+    // Frames rejected once complete, indexed by enum errors code
+    uint32_t errors[PROTOCOL_ERROR_COUNT];
+    // Start markers rejected by the length or version after them, most often
+    // 0xAA bytes in noise. They are still reported as LENGTH or VERSION
+    // frames, and acknowledged as such.
+    uint32_t stray_markers;
+    // Runs of bytes skipped while looking for a start marker
+    uint32_t resyncs;
+    // Bytes skipped while looking for a start marker
+    uint64_t bytes_skipped;
+};
+
+// Writes len bytes to the link of a connection. Returns the number of bytes
+// written.
+typedef int (*protocol_write_fn)(void *io, const uint8_t *data, size_t len);
+
+// State of one link: connection flag, output buffer, negotiated
+// capabilities, receive parser and statistics. The functions without a
+// connection argument work on protocol_default, the link of the device
+// itself. A host driving several links keeps one of these per link and uses
+// the protocol_conn_ functions.
+struct protocol_conn {
+    int connected;
+    // Output buffer holding frames that have not been flushed yet
+    uint8_t tx_buffer[PROTOCOL_TX_BUFFER_SIZE];
+    size_t tx_length;
+    // Time by which the first buffered byte must be flushed
+    uint64_t tx_deadline;
+    uint32_t flush_deadline_us;
+    // Where flushed output goes, platform_write if NULL
+    protocol_write_fn write;
+    void *io;
+    // Capabilities announced by the other side in its 'o' frame
+    struct protocol_caps peer_caps;
+    // Buffer holding the frame being received
+    uint8_t rx_buffer[PROTOCOL_MAX_FRAME_SIZE];
+    // Bytes of the frame received so far, and its length once known
+    size_t rx_length;
+    size_t rx_expected;
+    // Whether the parser is skipping bytes that precede a start marker
+    bool rx_skipping;
+    // Receive statistics
+    struct protocol_stats stats;
 };
 
+extern struct protocol_conn protocol_default;
+
+// Payload size accepted by a handler that takes payloads of any length.
+#define PROTOCOL_ANY_SIZE SIZE_MAX
+
+// Handles a frame of a registered type. The payload points into the receive
+// buffer and is only valid until the handler returns.
+typedef void (*protocol_handler)(const uint8_t *payload, size_t payload_length);
+
 uint8_t compute_crc(uint8_t *data, size_t len);
+// Builds a frame of the given type in packet, which must hold
+// payload_length + 7 bytes. Returns the length of the frame.
+size_t protocol_encode_frame(uint8_t *packet, uint8_t type,
+                             const uint8_t *payload, size_t payload_length);
 // Initializes the communication module.
 void protocol_init(void);
 // Opens a connection for communication.
@@ -28,15 +168,97 @@ int protocol_send(const uint8_t *payload, size_t payload_length);
 // Sends an acknowledgment over an established connection.
 // Returns the number of bytes sent.
 int protocol_send_ack(int err);
-// Sends an open connection message.
+// Sends an open connection message carrying our capabilities.
 int protocol_send_open();
+// Returns the capabilities announced by the other side. Fields are zero
+// until a capability block has been received.
+const struct protocol_caps *protocol_peer_caps();
+// Returns the largest frame size both sides accept.
+size_t protocol_frame_size();
 // Sends a close connection message.
 int protocol_send_close();
 int protocol_send_echo(const uint8_t *payload, size_t payload_length);
+// Sends a frame of a registered type.
+// Returns the number of bytes sent.
+int protocol_send_typed(uint8_t type, const uint8_t *payload,
+                        size_t payload_length);
+// Registers the handler for a frame type not used by the protocol itself.
+// Returns 0 on success, -1 if the type is reserved.
+int protocol_register_handler(uint8_t type, size_t payload_size,
+                              protocol_handler handler);
+// Returns the handler registered for a frame type, or NULL if there is none.
+protocol_handler protocol_get_handler(uint8_t type);
+// Queues raw bytes in the output buffer.
+// Returns the number of bytes queued or written.
+int protocol_write(const uint8_t *data, size_t len);
+// Sends all buffered output to the transport.
+// Returns the number of bytes written.
+int protocol_flush();
+// Sets how long buffered output may wait before being flushed.
+// 0 writes every frame straight through.
+void protocol_set_flush_deadline(uint32_t deadline_us);
+// Returns the number of bytes waiting in the output buffer.
+size_t protocol_pending();
+// Flushes buffered output whose deadline has passed. Call it from loops that
+// do not receive. Returns the number of bytes written.
+int protocol_poll();
+// Returns the offset of the first start marker in data, or len if there is
+// none.
+size_t protocol_find_start(const uint8_t *data, size_t len);
+// Feeds received bytes to the frame parser, stopping after the first
+// completed frame. Returns the number of bytes consumed.
+size_t protocol_parse(const uint8_t *data, size_t len,
+                      struct protocol_frame *frame);
+// Processes an intact frame based on its type.
+void protocol_dispatch(const uint8_t *packet, size_t packet_length);
 // Receives data from an established connection.
 // Returns the number of bytes received.
 int protocol_receive();
+// Drops bytes protocol_receive has read but not parsed yet.
+void protocol_discard_input();
+// Handles a chunk of received bytes.
+// Returns the number of frames completed.
+int protocol_receive_bytes(const uint8_t *data, size_t len);
+// Returns the receive statistics.
+const struct protocol_stats *protocol_get_stats();
+// Clears the receive statistics.
+void protocol_reset_stats();
 // Closes the connection.
 void protocol_disconnect();
 
+// Per-connection versions of the functions above. None of them touch the
+// platform I/O, except through a NULL write function.
+void protocol_conn_init(struct protocol_conn *conn, protocol_write_fn write,
+                        void *io);
+int protocol_conn_write(struct protocol_conn *conn, const uint8_t *data,
+                        size_t len);
+int protocol_conn_flush(struct protocol_conn *conn);
+void protocol_conn_set_flush_deadline(struct protocol_conn *conn,
+                                      uint32_t deadline_us);
+size_t protocol_conn_pending(const struct protocol_conn *conn);
+int protocol_conn_poll(struct protocol_conn *conn);
+int protocol_conn_send_ack(struct protocol_conn *conn, int err);
+int protocol_conn_send_open(struct protocol_conn *conn);
+int protocol_conn_send_typed(struct protocol_conn *conn, uint8_t type,
+                             const uint8_t *payload, size_t payload_length);
+const struct protocol_caps *
+protocol_conn_peer_caps(const struct protocol_conn *conn);
+size_t protocol_conn_frame_size(const struct protocol_conn *conn);
+// Decodes the capability block of an open frame. Returns false if it is too
+// short or has no version in common with ours.
+bool protocol_decode_caps(const uint8_t *payload, size_t payload_length,
+                          struct protocol_caps *caps);
+size_t protocol_conn_parse(struct protocol_conn *conn, const uint8_t *data,
+                           size_t len, struct protocol_frame *frame);
+void protocol_conn_dispatch(struct protocol_conn *conn, const uint8_t *packet,
+                            size_t packet_length);
+// Dispatches an intact frame, or acknowledges the error of a rejected one.
+void protocol_conn_handle_frame(struct protocol_conn *conn,
+                                const struct protocol_frame *frame);
+int protocol_conn_receive_bytes(struct protocol_conn *conn,
+                                const uint8_t *data, size_t len);
+const struct protocol_stats *
+protocol_conn_get_stats(const struct protocol_conn *conn);
+void protocol_conn_reset_stats(struct protocol_conn *conn);
+
 #endif
@@ -1,6 +1,7 @@
 import serial
+import socket
 import struct
-from time import sleep
+import time
 
 NO_ERROR = 0
 CRC = 1
@@ -9,6 +10,209 @@ ENDING = 3
 TYPE = 4
 OPENED = 5
 CLOSED = 6
+LENGTH = 7
+
+# Capability block carried by open packets: flags, lowest and highest
+# protocol version, maximum frame size, receive buffer count, and the
+# supported checksum, compression and framing options.
+CAPS = struct.Struct(">BBBHBBBB")
+CAPS_REPLY = 0x01
+CHECKSUM_CRC8 = 0x01
+COMPRESSION_NONE = 0x01
+FRAMING_MARKERS = 0x01
+VERSION_MIN = 2
+VERSION_MAX = 2
+MAX_FRAME_SIZE = 0xFFFF
+# Smallest frame that can carry a payload; a smaller announced maximum is
+# ignored.
+MIN_FRAME_SIZE = 8
+# Frame types the protocol itself defines; schema messages add their own.
+PROTOCOL_TYPES = b"adocetb"
+# Frame size used when the device does not announce its own, small enough
+# for any firmware version.
+DEFAULT_FRAME_SIZE = 64
+
+# Capture files, read by host/replay: see host/capture.h for the layout.
+CAPTURE_MAGIC = b"PICOCAP\x01"
+CAPTURE_RECORD = struct.Struct("<QIB3x")
+CAPTURE_FROM_DEVICE = 0
+CAPTURE_TO_DEVICE = 1
+
+# Benchmarks run by the 'b' command: see bench.h. A request holds one record
+# per benchmark, the reply the stopwatch rate followed by one result each.
+BENCH_KINDS = ("crc", "encode", "decode", "dispatch")
+BENCH_REQUEST = struct.Struct("<BHH")
+BENCH_RESULTS_HEADER = struct.Struct("<I")
+BENCH_RESULT = struct.Struct("<BHHHIIQ")
+
+
+def decode_benchmarks(payload: bytes):
+    """Decode the payload of a 'b' reply.
+
+    Args:
+        payload (bytes): The payload.
+
+    Returns:
+        tuple: (hz, rows), the stopwatch rate and one dict per benchmark with
+        its kind, size, iterations and wrapped runs, and the fastest run,
+        slowest run and mean in stopwatch ticks and the mean in microseconds
+        of the runs that did not wrap. Benchmarks the device could not run
+        have 0 iterations and no timings.
+    """
+    (hz,) = BENCH_RESULTS_HEADER.unpack_from(payload)
+    rows = []
+    for offset in range(BENCH_RESULTS_HEADER.size, len(payload), BENCH_RESULT.size):
+        kind, size, iterations, wrapped, min_ticks, max_ticks, total_ticks = (
+            BENCH_RESULT.unpack_from(payload, offset)
+        )
+        row = {
+            "kind": BENCH_KINDS[kind] if kind < len(BENCH_KINDS) else str(kind),
+            "size": size,
+            "iterations": iterations,
+            "wrapped": wrapped,
+        }
+        if iterations > 0:
+            timed = max(iterations - wrapped, 1)
+            row["min_ticks"] = min_ticks
+            row["max_ticks"] = max_ticks
+            row["mean_ticks"] = total_ticks / timed
+            row["mean_us"] = total_ticks / timed / hz * 1e6
+        rows.append(row)
+    return hz, rows
+
+
+def format_benchmarks(hz: int, rows) -> str:
+    """Lay out decoded benchmark results as a table.
+
+    Args:
+        hz (int): The stopwatch rate.
+        rows: The rows returned by decode_benchmarks.
+
+    Returns:
+        str: The table, in the layout host/bench_device prints.
+    """
+    lines = [
+        f"stopwatch at {hz / 1e6:.0f} MHz",
+        f"{'benchmark':<10} {'size':>6} {'iterations':>10} {'min ticks':>10} "
+        f"{'max ticks':>10} {'mean ticks':>10} {'mean us':>10} {'wrapped':>8}",
+    ]
+    for row in rows:
+        if row["iterations"] == 0:
+            lines.append(f"{row['kind']:<10} {row['size']:>6} {'not run':>10}")
+            continue
+        lines.append(
+            f"{row['kind']:<10} {row['size']:>6} {row['iterations']:>10} "
+            f"{row['min_ticks']:>10} {row['max_ticks']:>10} "
+            f"{row['mean_ticks']:>10.1f} {row['mean_us']:>10.3f} "
+            f"{row['wrapped']:>8}"
+        )
+    return "\n".join(lines)
+
+
+class Capture:
+    """Wraps a serial object and records every byte read or written.
+
+    Attributes:
+        link: The wrapped serial object.
+    """
+
+    def __init__(self, link, path: str):
+        """Start a capture file at path.
+
+        Args:
+            link: The serial object to wrap.
+            path (str): Where to write the capture.
+        """
+        self.link = link
+        self.__file = open(path, "wb")
+        self.__file.write(CAPTURE_MAGIC)
+        self.__start = time.monotonic_ns()
+
+    def __record(self, direction: int, data: bytes):
+        timestamp = (time.monotonic_ns() - self.__start) // 1000
+        self.__file.write(CAPTURE_RECORD.pack(timestamp, len(data), direction))
+        self.__file.write(data)
+
+    def read(self, size: int = 1):
+        data = self.link.read(size)
+        if data:
+            self.__record(CAPTURE_FROM_DEVICE, data)
+        return data
+
+    @property
+    def in_waiting(self):
+        return self.link.in_waiting
+
+    def write(self, data: bytes):
+        self.__record(CAPTURE_TO_DEVICE, data)
+        return self.link.write(data)
+
+    def close(self):
+        self.__file.close()
+        self.link.close()
+
+
+# Records exchanged with host/gateway: link index, payload length and frame
+# type, followed by the payload. See host/gateway.h.
+GATEWAY_RECORD = struct.Struct(">HHB")
+GATEWAY_SOCKET = "/tmp/pico-gateway.sock"
+
+
+class GatewayClient:
+    """Talks to many devices at once through host/gateway.
+
+    The gateway checks and strips the framing, so frames are exchanged as
+    (link, type, payload) tuples, where link is the index of the device in
+    the order it was given to the gateway.
+    """
+
+    def __init__(self, path: str = GATEWAY_SOCKET):
+        """Connect to a running gateway.
+
+        Args:
+            path (str, optional): The gateway's Unix socket.
+                Defaults to GATEWAY_SOCKET.
+        """
+        self.__sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.__sock.connect(path)
+        self.__buffer = b""
+
+    def send(self, link: int, message_type: bytes, payload: bytes = b""):
+        """Send a frame to one device.
+
+        Args:
+            link (int): Index of the device.
+            message_type (bytes): One byte frame type, e.g. b"e".
+            payload (bytes, optional): The payload. Defaults to b"".
+        """
+        header = GATEWAY_RECORD.pack(link, len(payload), message_type[0])
+        self.__sock.sendall(header + payload)
+
+    def receive(self):
+        """Wait for the next frame from any device.
+
+        Returns:
+            tuple: (link, type, payload), or None once the gateway has
+            closed the connection.
+        """
+        while True:
+            if len(self.__buffer) >= GATEWAY_RECORD.size:
+                link, length, message_type = GATEWAY_RECORD.unpack_from(
+                    self.__buffer
+                )
+                end = GATEWAY_RECORD.size + length
+                if len(self.__buffer) >= end:
+                    payload = self.__buffer[GATEWAY_RECORD.size : end]
+                    self.__buffer = self.__buffer[end:]
+                    return link, bytes([message_type]), payload
+            data = self.__sock.recv(65536)
+            if not data:
+                return None
+            self.__buffer += data
+
+    def close(self):
+        """Close the connection to the gateway."""
+        self.__sock.close()
 
 
 class CustomProtocol:
@@ -25,7 +229,9 @@ class CustomProtocol:
         __ser: Serial object representing the communication channel.
     """
 
-    def __init__(self, address: str = "/dev/ttyACM0", port: int = 115200):
+    def __init__(
+        self, address: str = "/dev/ttyACM0", port: int = 115200, capture: str = None
+    ):
         """Initialize CustomProtocol with specified address and port.
 
         Args:
@@ -33,14 +239,47 @@ class CustomProtocol:
                 Defaults to "/dev/ttyACM0".
             port (int, optional): The port number of the serial device.
                 Defaults to 115200.
+            capture (str, optional): Record the session to this capture file,
+                for replay with host/replay. Defaults to None.
         """
         self.__address = address
         self.__port = port
+        self.__capture = capture
+        self.__messages = {}
+        self.__peer_caps = None
+        self.__rx = b""
 
     def connect(self):
-        """Connect to the serial device and send an open packet."""
+        """Connect to the serial device and negotiate capabilities.
+
+        Sends an open packet carrying our capabilities and handles the answer,
+        which sets frame_size. Firmware that does not negotiate answers with
+        an empty open packet or an acknowledgement, in which case frame_size
+        stays at DEFAULT_FRAME_SIZE.
+
+        Returns:
+            int: The frame size picked for send_stream.
+        """
         self.__ser = serial.Serial(self.__address, self.__port)
+        if self.__capture is not None:
+            self.__ser = Capture(self.__ser, self.__capture)
+        self.__peer_caps = None
+        self.__rx = b""
         self.send_open()
+        self.receive()
+        return self.frame_size
+
+    @property
+    def peer_caps(self):
+        """tuple: Capability block received from the device, or None."""
+        return self.__peer_caps
+
+    @property
+    def frame_size(self):
+        """int: The largest frame size both sides accept."""
+        if self.__peer_caps is None or self.__peer_caps[3] < MIN_FRAME_SIZE:
+            return DEFAULT_FRAME_SIZE
+        return min(MAX_FRAME_SIZE, self.__peer_caps[3])
 
     def compute_crc(self, data: bytes):
         """Compute the CRC-8 checksum for the given data.
@@ -61,17 +300,46 @@ class CustomProtocol:
                     crc <<= 1
         return crc & 0xFF
 
+    def __encode(self, message_type: int, payload: bytes = b""):
+        """Build a packet: header, payload, CRC and end marker.
+
+        Args:
+            message_type (int): The frame type byte.
+            payload (bytes, optional): The payload. Defaults to b"".
+
+        Returns:
+            bytes: The packet.
+        """
+        header = struct.pack(">BHBB", 0xAA, len(payload) + 7, 2, message_type)
+        crc = self.compute_crc(header + payload + struct.pack(">BB", 0, 0xBB))
+        return header + payload + struct.pack(">BB", crc, 0xBB)
+
+    def __check_size(self, payload: bytes):
+        """Refuse a payload the device would answer with LENGTH.
+
+        Args:
+            payload (bytes): The payload of one packet.
+
+        Raises:
+            ValueError: If the packet would not fit the negotiated frame size.
+        """
+        if len(payload) + 7 > self.frame_size:
+            raise ValueError(
+                f"a {len(payload)} byte payload does not fit the "
+                f"{self.frame_size} byte frame size; use send_stream for data"
+            )
+
     def send(self, payload: bytes):
         """Construct and send a packet with the given payload.
 
         Args:
             payload (bytes): The payload to be sent.
+
+        Raises:
+            ValueError: If the packet would not fit the negotiated frame size.
         """
-        packet_length = len(payload) + 7
-        header = struct.pack(">BHBB", 0xAA, packet_length, 2, ord("d"))
-        packet = header + payload + struct.pack(">BB", 0, 0xBB)
-        crc = self.compute_crc(packet)
-        packet = header + payload + struct.pack(">BB", crc, 0xBB)
+        self.__check_size(payload)
+        packet = self.__encode(ord("d"), payload)
         self.__ser.write(packet)
         print(packet)
 
@@ -81,64 +349,186 @@ class CustomProtocol:
         Args:
             err: The error code to be sent in the acknowledgment packet.
         """
-        packet_length = 1 + 7
-        header = struct.pack(">BHBB", 0xAA, packet_length, 2, ord("a"))
-        crc = self.compute_crc(header + struct.pack(">BBB", err, 0, 0xBB))
-        footer = struct.pack(">BBB", err, crc, 0xBB)
-        packet = header + footer
-        self.__ser.write(packet)
+        self.__ser.write(self.__encode(ord("a"), bytes([err])))
 
-    def send_open(self):
-        """Send an open packet."""
-        packet_length = 7
-        header = struct.pack(">BHBB", 0xAA, packet_length, 2, ord("o"))
-        crc = self.compute_crc(header + struct.pack(">BB", 0, 0xBB))
-        footer = struct.pack(">BB", crc, 0xBB)
-        packet = header + footer
-        self.__ser.write(packet)
+    def send_open(self, reply: bool = False):
+        """Send an open packet carrying our capabilities.
+
+        Args:
+            reply (bool, optional): Whether this answers an open request from
+                the device. Defaults to False.
+        """
+        caps = CAPS.pack(
+            CAPS_REPLY if reply else 0,
+            VERSION_MIN,
+            VERSION_MAX,
+            MAX_FRAME_SIZE,
+            1,
+            CHECKSUM_CRC8,
+            COMPRESSION_NONE,
+            FRAMING_MARKERS,
+        )
+        self.send_typed(ord("o"), caps)
 
     def send_close(self):
         """Send a close packet."""
-        packet_length = 7
-        header = struct.pack(">BHBB", 0xAA, packet_length, 2, ord("c"))
-        crc = self.compute_crc(header + struct.pack(">BB", 0, 0xBB))
-        footer = struct.pack(">BB", crc, 0xBB)
-        packet = header + footer
-        self.__ser.write(packet)
+        self.__ser.write(self.__encode(ord("c")))
 
     def send_echo(self, payload: bytes):
         """Send an echo packet with the given payload.
 
         Args:
             payload (bytes): The payload to be echoed.
+
+        Raises:
+            ValueError: If the packet would not fit the negotiated frame size.
         """
-        packet_length = len(payload) + 7
-        header = struct.pack(">BHBB", 0xAA, packet_length, 2, ord("e"))
-        packet = header + payload + struct.pack(">BB", 0, 0xBB)
-        crc = self.compute_crc(packet)
-        packet = header + payload + struct.pack(">BB", crc, 0xBB)
-        self.__ser.write(packet)
+        self.send_typed(ord("e"), payload)
+
+    def send_stream(self, data: bytes):
+        """Send data of any length as data packets of the negotiated size.
+
+        All packets are handed to the serial port in a single write.
+
+        Args:
+            data (bytes): The data to be sent.
+        """
+        chunk = self.frame_size - 7
+        packets = []
+        for i in range(0, len(data), chunk):
+            packets.append(self.__encode(ord("d"), data[i : i + chunk]))
+        self.__ser.write(b"".join(packets))
+
+    def send_typed(self, message_type: int, payload: bytes):
+        """Construct and send a packet of a registered type.
+
+        Args:
+            message_type (int): The frame type byte.
+            payload (bytes): The payload to be sent.
+
+        Raises:
+            ValueError: If the packet would not fit the negotiated frame size.
+        """
+        self.__check_size(payload)
+        self.__ser.write(self.__encode(message_type, payload))
+
+    def benchmark(self, benchmarks=()):
+        """Run microbenchmarks on the device and print the results.
+
+        Args:
+            benchmarks: (kind, size) or (kind, size, iterations) tuples, with
+                kind one of BENCH_KINDS. Size is the buffer size for "crc"
+                and the frame size for the others. Runs the device's default
+                set if empty.
+
+        Returns:
+            tuple: (hz, rows) as returned by decode_benchmarks.
+        """
+        request = b"".join(
+            BENCH_REQUEST.pack(BENCH_KINDS.index(b[0]), b[1], b[2] if len(b) > 2 else 0)
+            for b in benchmarks
+        )
+        self.send_typed(ord("b"), request)
+        while True:
+            result = self.receive()
+            if isinstance(result, tuple):
+                print(format_benchmarks(*result))
+                return result
+            if result == b"length incorrect":
+                raise ValueError("the device refused the benchmark request")
+
+    def register_message(self, message):
+        """Decode frames of a schema message type in receive.
+
+        Args:
+            message: A message class generated by schemagen.py.
+        """
+        self.__messages[message.TYPE] = message
+
+    def send_message(self, message):
+        """Send a schema message as its own frame type.
+
+        Args:
+            message: An instance of a message class generated by schemagen.py.
+        """
+        self.send_typed(message.TYPE, message.encode())
+
+    def __read(self, size: int):
+        """Read exactly size bytes, taking whatever else is waiting with them.
+
+        Args:
+            size (int): Number of bytes to return.
+
+        Returns:
+            bytes: The next size bytes received.
+        """
+        while len(self.__rx) < size:
+            wanted = max(size - len(self.__rx), self.__ser.in_waiting)
+            self.__rx += self.__ser.read(wanted)
+        data = self.__rx[:size]
+        self.__rx = self.__rx[size:]
+        return data
+
+    def __plausible_start(self, candidate: bytes):
+        """Check whether a start marker and the bytes after it can begin a
+        frame.
+
+        Args:
+            candidate (bytes): The marker and at least four bytes after it.
+
+        Returns:
+            bool: False if the length, version, type or, when the whole frame
+                is already buffered, the end marker rule out a frame.
+        """
+        packet_length = struct.unpack_from(">H", candidate, 1)[0]
+        if packet_length < 7 or candidate[3] != 2:
+            return False
+        if candidate[4] not in PROTOCOL_TYPES and candidate[4] not in self.__messages:
+            return False
+        return len(candidate) < packet_length or candidate[packet_length - 1] == 0xBB
+
+    def __find_start(self):
+        """Discard received bytes up to the next start marker that can begin
+        a frame, in bulk.
+
+        Returns:
+            bytes: The start marker.
+        """
+        skipped = 0
+        while True:
+            start = self.__rx.find(b"\xAA")
+            if start < 0:
+                skipped += len(self.__rx)
+                self.__rx = self.__ser.read(max(1, self.__ser.in_waiting))
+                continue
+            skipped += start
+            self.__rx = self.__rx[start:]
+            while len(self.__rx) < 5:
+                self.__rx += self.__ser.read(max(1, self.__ser.in_waiting))
+            if self.__plausible_start(self.__rx):
+                break
+            # A stray marker: look for the next one after it
+            skipped += 1
+            self.__rx = self.__rx[1:]
+        if skipped > 0:
+            print(f"skipped {skipped} bytes before the start marker")
+        return self.__read(1)
 
     def receive(self):
         """Receive and process a packet."""
-        start_marker = self.__ser.read(1)
-        if start_marker != b"\xAA":
-            # Discard bytes until start marker is found
-            while start_marker != b"\xAA":
-                print("a---", start_marker)
-                start_marker = self.__ser.read(1)
-
-        length_byte = self.__ser.read(2)
+        start_marker = self.__find_start()
+
+        length_byte = self.__read(2)
         packet_length = struct.unpack(">H", length_byte)[0]
-        protocol_version = self.__ser.read(1)
+        protocol_version = self.__read(1)
         if protocol_version != b"\x02":
             self.send_ack(VERSION)
             print(f"incorrect protocol version: {protocol_version}")
-        message_type = self.__ser.read(1)
+        message_type = self.__read(1)
         payload_length = packet_length - 7
-        payload = self.__ser.read(payload_length)
+        payload = self.__read(payload_length)
 
-        received_crc = self.__ser.read(1)
+        received_crc = self.__read(1)
         computed_crc = self.compute_crc(
             start_marker
             + length_byte
@@ -154,7 +544,7 @@ class CustomProtocol:
                 f"incorrect crc: got {received_crc} , expected {struct.pack('>B', computed_crc)}"
             )
 
-        end_marker = self.__ser.read(1)
+        end_marker = self.__read(1)
         if end_marker != b"\xBB":
             self.send_ack(ENDING)
             print(f"not the last bit {end_marker}")
@@ -176,6 +566,8 @@ class CustomProtocol:
                     return b"connection opened"
                 elif payload == b"\x06":
                     return b"connection closed"
+                elif payload == b"\x07":
+                    return b"length incorrect"
                 else:
                     return b"unknow ack: " + payload
             case b"d":
@@ -183,16 +575,36 @@ class CustomProtocol:
                 return payload
             case b"o":
                 print("open")
-                self.send_open()
+                if len(payload) < CAPS.size:
+                    # Firmware that does not negotiate
+                    self.send_open()
+                    return b"open"
+                caps = CAPS.unpack_from(payload)
+                if caps[2] < VERSION_MIN or caps[1] > VERSION_MAX:
+                    self.send_ack(VERSION)
+                    return b"no common version"
+                self.__peer_caps = caps
+                # Only requests are answered, so replies do not bounce back
+                if not caps[0] & CAPS_REPLY:
+                    self.send_open(reply=True)
                 return b"open"
             case b"c":
                 print("close")
                 self.send_close()
                 return b"close"
+            case b"b":
+                print("benchmarks")
+                return decode_benchmarks(payload)
             case b"e":
                 print("echo", payload, len(payload))
                 self.send(payload)
                 return b"echo"
+            case _ if message_type[0] in self.__messages:
+                message = self.__messages[message_type[0]]
+                if len(payload) != message.SIZE:
+                    self.send_ack(LENGTH)
+                    return b"wrong length: " + message_type
+                return message.decode(payload)
             case _:
                 print("wrong")
                 self.send_ack(TYPE)
@@ -212,19 +624,15 @@ class CustomProtocol:
 
     def test(self):
         """Send a test packet and print received messages."""
-        packet_length = 7
-        header = struct.pack(">BHBB", 0xAA, packet_length, 2, ord("t"))
-        crc = self.compute_crc(header + struct.pack(">BB", 0, 0xBB))
-        footer = struct.pack(">BB", crc, 0xBB)
-        packet = header + footer
-        self.__ser.write(packet)
+        self.__ser.write(self.__encode(ord("t")))
         for _ in range(100):
             print(self.receive())
 
 
-p = CustomProtocol()
-p.connect()
-p.receive()
-p.test()
+if __name__ == "__main__":
+    p = CustomProtocol()
+    p.connect()
+    p.test()
+
+    p.disconnect()
 
-p.disconnect()
@@ -0,0 +1,108 @@
+#ifndef SCHEMA_H
+#define SCHEMA_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Little-endian field access used by the code generated from schemas/.
+// Fields can sit at any offset in the receive buffer, so they are accessed
+// through memcpy, which the compiler turns into a single load on targets
+// that allow unaligned access and into byte loads on the Cortex-M0+.
+// Big-endian targets assemble the value byte by byte instead.
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SCHEMA_LITTLE_ENDIAN 1
+#endif
+
+static inline uint8_t schema_load_u8(const uint8_t *p) { return p[0]; }
+
+static inline uint16_t schema_load_u16(const uint8_t *p) {
+#ifdef SCHEMA_LITTLE_ENDIAN
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+#else
+    return (uint16_t)(p[0] | p[1] << 8);
+#endif
+}
+
+static inline uint32_t schema_load_u32(const uint8_t *p) {
+#ifdef SCHEMA_LITTLE_ENDIAN
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+#else
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+           (uint32_t)p[3] << 24;
+#endif
+}
+
+static inline uint64_t schema_load_u64(const uint8_t *p) {
+#ifdef SCHEMA_LITTLE_ENDIAN
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+#else
+    return (uint64_t)schema_load_u32(p) |
+           (uint64_t)schema_load_u32(p + 4) << 32;
+#endif
+}
+
+static inline float schema_load_f32(const uint8_t *p) {
+    uint32_t bits = schema_load_u32(p);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static inline double schema_load_f64(const uint8_t *p) {
+    uint64_t bits = schema_load_u64(p);
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static inline void schema_store_u8(uint8_t *p, uint8_t v) { p[0] = v; }
+
+static inline void schema_store_u16(uint8_t *p, uint16_t v) {
+#ifdef SCHEMA_LITTLE_ENDIAN
+    memcpy(p, &v, sizeof(v));
+#else
+    p[0] = v;
+    p[1] = v >> 8;
+#endif
+}
+
+static inline void schema_store_u32(uint8_t *p, uint32_t v) {
+#ifdef SCHEMA_LITTLE_ENDIAN
+    memcpy(p, &v, sizeof(v));
+#else
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+#endif
+}
+
+static inline void schema_store_u64(uint8_t *p, uint64_t v) {
+#ifdef SCHEMA_LITTLE_ENDIAN
+    memcpy(p, &v, sizeof(v));
+#else
+    schema_store_u32(p, (uint32_t)v);
+    schema_store_u32(p + 4, (uint32_t)(v >> 32));
+#endif
+}
+
+static inline void schema_store_f32(uint8_t *p, float v) {
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    schema_store_u32(p, bits);
+}
+
+static inline void schema_store_f64(uint8_t *p, double v) {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    schema_store_u64(p, bits);
+}
+
+#endif
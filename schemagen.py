@@ -0,0 +1,386 @@
+"""Generates C accessors and Python codecs from message schemas.
+
+A schema file describes fixed-layout message types. Every field is stored
+little-endian, packed with no padding, in the order it is declared:
+
+    # comment
+    message telemetry 'T'
+        u32 timestamp_us
+        i16 temperature
+        u8 label[8]
+    end
+
+The value after the message name is the frame type byte the message is sent
+with, written as a character ('T') or a number (0x54). Supported field types
+are u8, i8, u16, i16, u32, i32, u64, i64, f32 and f64, optionally as a fixed
+size array.
+
+Usage:
+
+    python3 schemagen.py schemas/telemetry.schema --c telemetry.h --py telemetry.py
+"""
+
+import argparse
+import keyword
+import os
+import re
+import sys
+
+# name: (C type, schema.h suffix, struct format character, numpy type)
+FIELD_TYPES = {
+    "u8": ("uint8_t", "u8", "B", "<u1"),
+    "i8": ("int8_t", "u8", "b", "<i1"),
+    "u16": ("uint16_t", "u16", "H", "<u2"),
+    "i16": ("int16_t", "u16", "h", "<i2"),
+    "u32": ("uint32_t", "u32", "I", "<u4"),
+    "i32": ("int32_t", "u32", "i", "<i4"),
+    "u64": ("uint64_t", "u64", "Q", "<u8"),
+    "i64": ("int64_t", "u64", "q", "<i8"),
+    "f32": ("float", "f32", "f", "<f4"),
+    "f64": ("double", "f64", "d", "<f8"),
+}
+
+FIELD_SIZES = {"u8": 1, "u16": 2, "u32": 4, "u64": 8, "f32": 4, "f64": 8}
+
+# PROTOCOL_MAX_FRAME_SIZE in protocol.h; a message has to fit in a frame
+# together with the 7 bytes of header and footer. Keep the two in sync.
+MAX_FRAME_SIZE = 1024
+FRAME_OVERHEAD = 7
+
+# Frame types handled by protocol.c itself, listed in
+# protocol_register_handler. Keep the two in sync.
+RESERVED_TYPES = {ord(c) for c in "adocetb"}
+
+# Attributes of the generated NamedTuple classes a field would shadow
+RESERVED_NAMES = {"count", "index", "encode", "decode"}
+
+NAME = re.compile(r"^[a-z_][a-z0-9_]*$")
+MESSAGE = re.compile(r"^message\s+(\w+)\s+('.'|0x[0-9a-fA-F]+|\d+)$")
+FIELD = re.compile(r"^(\w+)\s+(\w+)(?:\[(\d+)\])?$")
+
+
+class SchemaError(Exception):
+    """Raised when a schema file cannot be parsed."""
+
+
+class Field:
+    """A single field of a message.
+
+    Attributes:
+        name (str): Field name.
+        kind (str): Schema type, e.g. "u16".
+        count (int): Number of elements, 1 for a scalar.
+        offset (int): Byte offset within the payload.
+        array (bool): Whether the field was declared as an array.
+    """
+
+    def __init__(self, name: str, kind: str, count: int, offset: int, array: bool):
+        self.name = name
+        self.kind = kind
+        self.count = count
+        self.offset = offset
+        self.array = array
+
+    @property
+    def size(self):
+        """int: Size of one element in bytes."""
+        return FIELD_SIZES[FIELD_TYPES[self.kind][1]]
+
+
+class Message:
+    """A message type made of fixed-layout fields.
+
+    Attributes:
+        name (str): Message name, used as prefix for generated code.
+        type (int): Frame type byte.
+        fields (list[Field]): Fields in wire order.
+    """
+
+    def __init__(self, name: str, type: int):
+        self.name = name
+        self.type = type
+        self.fields = []
+        self.size = 0
+
+    def add_field(self, name: str, kind: str, count: int, array: bool):
+        field = Field(name, kind, count, self.size, array)
+        self.fields.append(field)
+        self.size += field.size * count
+
+
+def parse(text: str, filename: str = "<schema>", max_frame_size: int = MAX_FRAME_SIZE):
+    """Parse a schema.
+
+    Args:
+        text (str): Contents of the schema file.
+        filename (str): Name used in error messages.
+        max_frame_size (int): Largest frame the device accepts, see
+            PROTOCOL_MAX_FRAME_SIZE.
+
+    Returns:
+        list[Message]: The messages, in the order they are declared.
+    """
+    messages = []
+    types = {}
+    current = None
+    for number, line in enumerate(text.splitlines(), 1):
+        line = line.split("#", 1)[0].strip()
+        if not line:
+            continue
+
+        def error(message):
+            return SchemaError(f"{filename}:{number}: {message}")
+
+        if current is None:
+            match = MESSAGE.match(line)
+            if not match:
+                raise error(f"expected 'message <name> <type>', got '{line}'")
+            name, type_text = match.groups()
+            if not NAME.match(name):
+                raise error(f"invalid message name '{name}'")
+            if keyword.iskeyword(name):
+                raise error(f"message name '{name}' is a Python keyword")
+            if type_text.startswith("'"):
+                type = ord(type_text[1])
+            else:
+                type = int(type_text, 0)
+            if type > 0xFF:
+                raise error(f"type {type_text} does not fit in a byte")
+            if type in RESERVED_TYPES:
+                raise error(f"type {type_text} is used by the protocol itself")
+            if type in types:
+                raise error(f"type {type_text} is already used by '{types[type]}'")
+            types[type] = name
+            current = Message(name, type)
+        elif line == "end":
+            if not current.fields:
+                raise error(f"message '{current.name}' has no fields")
+            if current.size + FRAME_OVERHEAD > max_frame_size:
+                raise error(
+                    f"message '{current.name}' is {current.size} bytes, more than "
+                    f"the {max_frame_size - FRAME_OVERHEAD} that fit in a frame"
+                )
+            messages.append(current)
+            current = None
+        else:
+            match = FIELD.match(line)
+            if not match:
+                raise error(f"expected '<type> <name>' or '<type> <name>[N]', got '{line}'")
+            kind, name, count = match.groups()
+            if kind not in FIELD_TYPES:
+                raise error(f"unknown field type '{kind}'")
+            if not NAME.match(name) or name.startswith("_"):
+                raise error(f"invalid field name '{name}'")
+            if keyword.iskeyword(name):
+                raise error(f"field name '{name}' is a Python keyword")
+            if name in RESERVED_NAMES:
+                raise error(f"field name '{name}' is reserved")
+            if any(field.name == name for field in current.fields):
+                raise error(f"duplicate field '{name}'")
+            if count is not None and int(count) == 0:
+                raise error(f"array '{name}' must have at least one element")
+            current.add_field(name, kind, int(count or 1), count is not None)
+    if current is not None:
+        raise SchemaError(f"{filename}: message '{current.name}' is missing 'end'")
+    return messages
+
+
+def generate_c(messages, guard: str):
+    """Generate a C header with in-place accessors.
+
+    Getters read straight out of the payload, so a handler can use the
+    receive buffer without copying it into a struct first. Each message also
+    gets helpers to register its handler and to send it as its own frame type.
+
+    Args:
+        messages (list[Message]): Messages to generate code for.
+        guard (str): Include guard name.
+
+    Returns:
+        str: The header contents.
+    """
+    out = [
+        "// Generated by schemagen.py, do not edit.",
+        f"#ifndef {guard}",
+        f"#define {guard}",
+        "",
+        '#include "protocol.h"',
+        '#include "schema.h"',
+        "#include <stdbool.h>",
+        "#include <stddef.h>",
+        "#include <stdint.h>",
+        "",
+    ]
+    for message in messages:
+        prefix = message.name.upper()
+        out.append(f"#define {prefix}_TYPE 0x{message.type:02X}")
+        out.append(f"#define {prefix}_SIZE {message.size}")
+        out.append(
+            f"_Static_assert({prefix}_SIZE + {FRAME_OVERHEAD} <= PROTOCOL_MAX_FRAME_SIZE,"
+        )
+        out.append(f'               "{message.name} does not fit in a frame");')
+        out.append("")
+        out.append(f"static inline bool {message.name}_valid(size_t payload_length) {{")
+        out.append(f"    return payload_length == {prefix}_SIZE;")
+        out.append("}")
+        out.append(f"static inline int {message.name}_register(protocol_handler handler) {{")
+        out.append(f"    return protocol_register_handler({prefix}_TYPE, {prefix}_SIZE, handler);")
+        out.append("}")
+        out.append(f"static inline int {message.name}_send(const uint8_t *p) {{")
+        out.append(f"    return protocol_send_typed({prefix}_TYPE, p, {prefix}_SIZE);")
+        out.append("}")
+        out.append("")
+        for field in message.fields:
+            c_type, suffix, _, _ = FIELD_TYPES[field.kind]
+            load = f"schema_load_{suffix}"
+            store = f"schema_store_{suffix}"
+            getter = f"{message.name}_get_{field.name}"
+            setter = f"{message.name}_set_{field.name}"
+            if field.array:
+                address = f"p + {field.offset} + i * {field.size}"
+                out.append(f"#define {prefix}_{field.name.upper()}_COUNT {field.count}")
+                out.append(f"static inline {c_type} {getter}(const uint8_t *p, size_t i) {{")
+                out.append(f"    return ({c_type}){load}({address});")
+                out.append("}")
+                out.append(f"static inline void {setter}(uint8_t *p, size_t i, {c_type} v) {{")
+                cast = "" if suffix.startswith("f") else f"(uint{field.size * 8}_t)"
+                out.append(f"    {store}({address}, {cast}v);")
+                out.append("}")
+            else:
+                address = f"p + {field.offset}"
+                out.append(f"static inline {c_type} {getter}(const uint8_t *p) {{")
+                out.append(f"    return ({c_type}){load}({address});")
+                out.append("}")
+                out.append(f"static inline void {setter}(uint8_t *p, {c_type} v) {{")
+                cast = "" if suffix.startswith("f") else f"(uint{field.size * 8}_t)"
+                out.append(f"    {store}({address}, {cast}v);")
+                out.append("}")
+        out.append("")
+    out.append("#endif")
+    return "\n".join(out) + "\n"
+
+
+def struct_format(message):
+    """Return the struct module format string for a message."""
+    return "<" + "".join(
+        (str(field.count) if field.count > 1 else "") + FIELD_TYPES[field.kind][2]
+        for field in message.fields
+    )
+
+
+def class_name(message):
+    """Return the Python class name for a message."""
+    return "".join(part.capitalize() for part in message.name.split("_"))
+
+
+def generate_py(messages):
+    """Generate a Python module with a codec per message.
+
+    Each codec uses a precompiled struct.Struct. Arrays are returned as
+    tuples. A numpy dtype description is included for decoding many messages
+    at once with numpy.frombuffer.
+
+    Args:
+        messages (list[Message]): Messages to generate code for.
+
+    Returns:
+        str: The module contents.
+    """
+    out = [
+        '"""Generated by schemagen.py, do not edit."""',
+        "",
+        "import struct",
+        "from typing import NamedTuple",
+        "",
+    ]
+    for message in messages:
+        name = class_name(message)
+        out.append("")
+        out.append(f"class {name}(NamedTuple):")
+        out.append(f'    """Message \'{message.name}\', sent as frame type 0x{message.type:02X}."""')
+        out.append("")
+        for field in message.fields:
+            py_type = "float" if field.kind.startswith("f") else "int"
+            if field.array:
+                py_type = f"tuple[{py_type}, ...]"
+            out.append(f"    {field.name}: {py_type}")
+        out.append("")
+        out.append(f"    TYPE = 0x{message.type:02X}")
+        out.append(f"    SIZE = {message.size}")
+        out.append(f'    STRUCT = struct.Struct("{struct_format(message)}")')
+        dtype = ", ".join(
+            f'("{field.name}", "{FIELD_TYPES[field.kind][3]}"'
+            + (f", ({field.count},))" if field.array else ")")
+            for field in message.fields
+        )
+        out.append(f"    NUMPY_DTYPE = [{dtype}]")
+        out.append("")
+
+        flat = any(field.array for field in message.fields)
+        out.append("    def encode(self) -> bytes:")
+        out.append('        """Pack the message into a payload."""')
+        if flat:
+            args = ", ".join(
+                f"*self.{field.name}" if field.array else f"self.{field.name}"
+                for field in message.fields
+            )
+            out.append(f"        return self.STRUCT.pack({args})")
+        else:
+            out.append("        return self.STRUCT.pack(*self)")
+        out.append("")
+        out.append("    @classmethod")
+        out.append(f'    def decode(cls, payload, offset: int = 0) -> "{name}":')
+        out.append('        """Unpack a message from a payload without copying it."""')
+        if flat:
+            out.append("        values = cls.STRUCT.unpack_from(payload, offset)")
+            args = []
+            index = 0
+            for field in message.fields:
+                if field.array:
+                    args.append(f"values[{index}:{index + field.count}]")
+                else:
+                    args.append(f"values[{index}]")
+                index += field.count
+            out.append(f"        return cls({', '.join(args)})")
+        else:
+            out.append("        return cls._make(cls.STRUCT.unpack_from(payload, offset))")
+        out.append("")
+    out.append("")
+    names = "".join(f"{class_name(message)}, " for message in messages)
+    out.append(f"MESSAGES = ({names.rstrip()})")
+    return "\n".join(out) + "\n"
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.split("\n", 1)[0])
+    parser.add_argument("schema", help="schema file to read")
+    parser.add_argument("--c", help="C header to write")
+    parser.add_argument("--py", help="Python module to write")
+    parser.add_argument(
+        "--max-frame-size",
+        type=int,
+        default=MAX_FRAME_SIZE,
+        help="PROTOCOL_MAX_FRAME_SIZE of the firmware (default %(default)s)",
+    )
+    args = parser.parse_args(argv)
+
+    with open(args.schema) as f:
+        try:
+            messages = parse(f.read(), args.schema, args.max_frame_size)
+        except SchemaError as e:
+            print(e, file=sys.stderr)
+            return 1
+
+    base = os.path.splitext(os.path.basename(args.schema))[0]
+    if args.c:
+        guard = "SCHEMA_" + re.sub(r"\W", "_", base).upper() + "_H"
+        with open(args.c, "w") as f:
+            f.write(generate_c(messages, guard))
+    if args.py:
+        with open(args.py, "w") as f:
+            f.write(generate_py(messages))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
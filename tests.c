@@ -1,7 +1,24 @@
 #include "tests.h"
+#include "bench.h"
 #include "protocol.h"
+#include "pipeline.h"
+#include "platform.h"
+#include "telemetry.h"
 #include <stdio.h>
 
+// How long the other side gets to answer before the link counts as quiet
+#define DRAIN_TIMEOUT_US 100000
+
+// Sends buffered output and throws away everything received until the other
+// side has nothing more to say, so the next receive gets the answer to the
+// next frame sent rather than a leftover from an earlier test.
+static void drain() {
+    protocol_flush();
+    protocol_discard_input();
+    while (platform_getc(DRAIN_TIMEOUT_US) != PLATFORM_TIMEOUT) {
+    }
+}
+
 int wrong() {
     size_t packet_length = 7;
     uint8_t packet[packet_length];
@@ -10,10 +27,8 @@ int wrong() {
     memcpy(packet, header, 5);
     memcpy(packet + 5, footer, 2);
 
-    // Print packet (just for demonstration)
-    for (size_t i = 0; i < packet_length; i++) {
-        putchar(packet[i]);
-    }
+    // Queue packet behind the frames that were sent before it
+    protocol_write(packet, packet_length);
     return packet_length;
 }
 
@@ -38,6 +53,18 @@ void run_tests() {
     test18();
     test19();
     test20();
+    test21();
+    test22();
+    test23();
+    test24();
+    test25();
+    test26();
+    test27();
+    test28();
+    test29();
+    test30();
+    test31();
+    test32();
 }
 
 void test1() {
@@ -171,7 +198,7 @@ void test10() {
     int packet_length = protocol_send_open();
     protocol_receive();
     char res[] = "10 ";
-    if (packet_length == 7) {
+    if (packet_length == 7 + PROTOCOL_CAPS_SIZE) {
         res[2] = 't';
     } else {
         res[2] = 'f';
@@ -261,11 +288,12 @@ void test16() {
 
 void test17() {
     // Test 17: Test the protocol_receive function after sending an open
-    // message.
+    // message, which is answered with the other side's capabilities.
+    drain();
     protocol_send_open();
     int bytes_received = protocol_receive();
     char res[] = "17 ";
-    if (bytes_received == 7) {
+    if (bytes_received == 7 + PROTOCOL_CAPS_SIZE) {
         res[2] = 't';
     } else {
         res[2] = 'f';
@@ -276,6 +304,7 @@ void test17() {
 void test18() {
     // Test 18: Test the protocol_receive function after sending a close
     // message.
+    drain();
     protocol_send_close();
     int bytes_received = protocol_receive();
     char res[] = "18 ";
@@ -289,13 +318,14 @@ void test18() {
 
 void test19() {
     // Test 19: Test the protocol_receive function after sending an echo
-    // message.
+    // message, which is answered with a data frame holding the payload.
     uint8_t payload[] = {0x00, 0x01, 0x02};
+    drain();
     protocol_send_echo(payload, 3);
     int bytes_received = protocol_receive();
     printf("%d", bytes_received);
     char res[] = "19 ";
-    if (bytes_received == 7) {
+    if (bytes_received == 10) {
         res[2] = 't';
     } else {
         res[2] = 'f';
@@ -304,15 +334,474 @@ void test19() {
 }
 void test20() {
     // Test 20: Test the protocol_receive function after sending a wrong crc
-    // message.
+    // message, which is answered with a CRC acknowledgement.
     uint8_t payload[] = {0x00, 0x01, 0x02};
+    drain();
     wrong();
     int bytes_received = protocol_receive();
     char res[] = "20 ";
-    if (bytes_received == 7) {
+    if (bytes_received == 8) {
+        res[2] = 't';
+    } else {
+        res[2] = 'f';
+    }
+    protocol_send(res, 3);
+}
+
+void test21() {
+    // Test 21: Test that consecutive frames are coalesced in the output
+    // buffer until protocol_flush is called.
+    protocol_set_flush_deadline(PROTOCOL_NO_DEADLINE);
+    uint8_t payload[] = {0x00, 0x01};
+    protocol_send(payload, 2);
+    protocol_send(payload, 2);
+    size_t buffered = protocol_pending();
+    protocol_flush();
+    char res[] = "21 ";
+    if (buffered == 18 && protocol_pending() == 0) {
+        res[2] = 't';
+    } else {
+        res[2] = 'f';
+    }
+    protocol_set_flush_deadline(PROTOCOL_FLUSH_DEADLINE_US);
+    protocol_send(res, 3);
+}
+
+void test22() {
+    // Test 22: Test that a frame larger than the output buffer is written
+    // straight through without staying in the buffer.
+    protocol_set_flush_deadline(PROTOCOL_NO_DEADLINE);
+    uint8_t payload[PROTOCOL_TX_BUFFER_SIZE];
+    for (size_t i = 0; i < PROTOCOL_TX_BUFFER_SIZE; i++) {
+        payload[i] = 96;
+    }
+    protocol_send(payload, 2);
+    int packet_length = protocol_send(payload, PROTOCOL_TX_BUFFER_SIZE);
+    char res[] = "22 ";
+    if (packet_length == PROTOCOL_TX_BUFFER_SIZE + 7 &&
+        protocol_pending() == 0) {
+        res[2] = 't';
+    } else {
+        res[2] = 'f';
+    }
+    protocol_set_flush_deadline(PROTOCOL_FLUSH_DEADLINE_US);
+    protocol_send(res, 3);
+}
+
+void test23() {
+    // Test 23: Test that generated accessors read back the fields they
+    // wrote, at an unaligned offset as in the receive buffer.
+    uint8_t buffer[TELEMETRY_SIZE + 1];
+    uint8_t *p = buffer + 1;
+    telemetry_set_timestamp_us(p, 0x12345678);
+    telemetry_set_temperature(p, -273);
+    telemetry_set_voltage_mv(p, 3300);
+    telemetry_set_current(p, 0.5f);
+    telemetry_set_flags(p, 0x81);
+    for (size_t i = 0; i < TELEMETRY_LABEL_COUNT; i++) {
+        telemetry_set_label(p, i, 'a' + i);
+    }
+    char res[] = "23 ";
+    if (telemetry_get_timestamp_us(p) == 0x12345678 && p[0] == 0x78 &&
+        telemetry_get_temperature(p) == -273 &&
+        telemetry_get_voltage_mv(p) == 3300 &&
+        telemetry_get_current(p) == 0.5f && telemetry_get_flags(p) == 0x81 &&
+        telemetry_get_label(p, 7) == 'h') {
+        res[2] = 't';
+    } else {
+        res[2] = 'f';
+    }
+    protocol_send(res, 3);
+}
+
+static void ignore_telemetry(const uint8_t *payload, size_t payload_length) {}
+
+void test24() {
+    // Test 24: Test that schema types can be registered but built in types
+    // cannot be taken over.
+    int reserved = protocol_register_handler('d', 0, ignore_telemetry);
+    int registered = telemetry_register(ignore_telemetry);
+    telemetry_register(NULL);
+    char res[] = "24 ";
+    if (reserved == -1 && registered == 0) {
+        res[2] = 't';
+    } else {
+        res[2] = 'f';
+    }
+    protocol_send(res, 3);
+}
+
+void test25() {
+    // Test 25: Test that the capabilities received in test 17 were stored
+    // and give a frame size both sides can handle.
+    const struct protocol_caps *caps = protocol_peer_caps();
+    size_t frame_size = protocol_frame_size();
+    char res[] = "25 ";
+    if (caps->version_min <= 2 && caps->version_max >= 2 &&
+        (caps->checksums & PROTOCOL_CHECKSUM_CRC8) && frame_size >= 7 &&
+        frame_size <= PROTOCOL_MAX_FRAME_SIZE &&
+        frame_size <= caps->max_frame_size) {
+        res[2] = 't';
+    } else {
+        res[2] = 'f';
+    }
+    protocol_send(res, 3);
+}
+
+static size_t make_frame(uint8_t *packet, const uint8_t *payload,
+                         size_t payload_length) {
+    return protocol_encode_frame(packet, 'd', payload, payload_length);
+}
+
+void test26() {
+    // Test 26: Test that the parser skips junk, splits a stream fed in
+    // uneven chunks into frames, and counts rejected frames by error code
+    // and stray markers on their own.
+    uint8_t stream[64];
+    uint8_t payload[] = "abc";
+    size_t len = 0;
+    memcpy(stream, "junk", 4);
+    len += 4;
+    len += make_frame(stream + len, payload, 3);
+    size_t corrupted = len;
+    len += make_frame(stream + len, payload, 3);
+    stream[corrupted + 6] ^= 0x01;
+    // A header announcing a frame too large for the receive buffer, whose
+    // version byte is then skipped as junk
+    stream[len++] = 0xAA;
+    stream[len++] = 0xFF;
+    stream[len++] = 0xFF;
+    stream[len++] = 0x02;
+    len += make_frame(stream + len, payload, 3);
+
+    struct protocol_stats before = *protocol_get_stats();
+    int good = 0;
+    int bad = 0;
+    size_t offset = 0;
+    while (offset < len) {
+        // Feed at most 5 bytes at a time so frames span several calls
+        size_t chunk = len - offset < 5 ? len - offset : 5;
+        struct protocol_frame frame;
+        offset += protocol_parse(stream + offset, chunk, &frame);
+        if (frame.length > 0 && frame.error == NO_ERROR) {
+            good++;
+        } else if (frame.length > 0) {
+            bad++;
+        }
+    }
+    const struct protocol_stats *after = protocol_get_stats();
+    char res[] = "26 ";
+    if (good == 2 && bad == 2 && after->frames - before.frames == 2 &&
+        after->errors[CRC] - before.errors[CRC] == 1 &&
+        after->stray_markers - before.stray_markers == 1 &&
+        after->bytes_skipped - before.bytes_skipped == 5) {
+        res[2] = 't';
+    } else {
+        res[2] = 'f';
+    }
+    protocol_send(res, 3);
+}
+
+static int count_write(void *io, const uint8_t *data, size_t len) {
+    *(size_t *)io += len;
+    return len;
+}
+
+void test27() {
+    // Test 27: Test that two connections keep separate state: an echo
+    // received on one is answered on that one only, and neither touches the
+    // statistics of the device link.
+    static struct protocol_conn a;
+    static struct protocol_conn b;
+    size_t a_written = 0;
+    size_t b_written = 0;
+    protocol_conn_init(&a, count_write, &a_written);
+    protocol_conn_init(&b, count_write, &b_written);
+    protocol_conn_set_flush_deadline(&a, 0);
+    protocol_conn_set_flush_deadline(&b, 0);
+
+    uint8_t packet[16];
+    uint8_t payload[] = "abc";
+    size_t len = make_frame(packet, payload, 3);
+    packet[4] = 'e';
+    packet[len - 2] = 0;
+    packet[len - 2] = compute_crc(packet, len);
+
+    struct protocol_stats before = *protocol_get_stats();
+    // Feed half a frame to b, which must not complete on a's bytes
+    protocol_conn_receive_bytes(&b, packet, 4);
+    int frames = protocol_conn_receive_bytes(&a, packet, len);
+    char res[] = "27 ";
+    if (frames == 1 && a_written == len && b_written == 0 &&
+        protocol_conn_get_stats(&a)->frames == 1 &&
+        protocol_conn_get_stats(&b)->frames == 0 &&
+        protocol_conn_get_stats(&b)->bytes == 4 &&
+        protocol_get_stats()->bytes == before.bytes) {
+        res[2] = 't';
+    } else {
+        res[2] = 'f';
+    }
+    protocol_send(res, 3);
+}
+
+void test28() {
+    // Test 28: Test that the pipeline ring pushes back when it is full, and
+    // that frames come out whole and in order while it wraps around.
+    static struct protocol_conn conn;
+    static struct pipeline pipeline;
+    size_t written = 0;
+    protocol_conn_init(&conn, count_write, &written);
+    pipeline_init(&pipeline, &conn);
+
+    uint8_t packet[100 + 7];
+    uint8_t payload[100];
+    size_t len = 0;
+    size_t offset = 0;
+    // Enough frames to go round the ring three times
+    int total = 3 * PIPELINE_RING_SIZE / sizeof(packet);
+    int sent = 0;
+    int received = 0;
+    bool ok = true;
+    while (received < total) {
+        // Retry a frame left over from a full ring
+        pipeline_receive(&pipeline, packet, 0);
+        // Feed frames until the ring pushes back
+        while (sent < total) {
+            if (offset == len) {
+                memset(payload, sent, sizeof(payload));
+                len = make_frame(packet, payload, sizeof(payload));
+                offset = 0;
+            }
+            size_t n =
+                pipeline_receive(&pipeline, packet + offset, len - offset);
+            offset += n;
+            if (n == 0) {
+                break;
+            }
+            if (offset == len) {
+                sent++;
+            }
+        }
+        // Then empty it
+        struct protocol_frame frame;
+        while (pipeline_peek(&pipeline, &frame)) {
+            if (frame.error != NO_ERROR || frame.length != sizeof(packet) ||
+                frame.packet[5] != (uint8_t)received ||
+                frame.packet[5 + sizeof(payload) - 1] != (uint8_t)received) {
+                ok = false;
+            }
+            received++;
+            pipeline_release(&pipeline);
+        }
+    }
+    char res[] = "28 ";
+    if (ok && received == total && pipeline.stalls > 0 && written == 0) {
+        res[2] = 't';
+    } else {
+        res[2] = 'f';
+    }
+    protocol_send(res, 3);
+}
+
+void test29() {
+    // Test 29: Test that the start marker search agrees with a plain scan at
+    // every alignment, and that stray markers are rejected by their header
+    // without hiding the frame after them, counted apart from frame errors,
+    // whether the stream comes in one chunk or a byte at a time.
+    uint8_t buffer[80];
+    bool ok = true;
+    for (size_t start = 0; start < 8; start++) {
+        for (size_t marker = start; marker <= sizeof(buffer); marker++) {
+            memset(buffer, 0x55, sizeof(buffer));
+            if (marker < sizeof(buffer)) {
+                buffer[marker] = 0xAA;
+            }
+            size_t len = sizeof(buffer) - start;
+            if (protocol_find_start(buffer + start, len) != marker - start) {
+                ok = false;
+            }
+        }
+    }
+
+    uint8_t stream[64];
+    uint8_t payload[] = "abc";
+    size_t len = 0;
+    // A marker with a length too short for a frame
+    uint8_t short_length[] = {'x', 0xAA, 0x00, 0x03};
+    // A marker with an unknown version
+    uint8_t bad_version[] = {0xAA, 0x01, 0x00, 0x05};
+    memcpy(stream + len, short_length, sizeof(short_length));
+    len += sizeof(short_length);
+    memcpy(stream + len, bad_version, sizeof(bad_version));
+    len += sizeof(bad_version);
+    len += make_frame(stream + len, payload, 3);
+
+    // Whole and a byte at a time, with the same outcome
+    static struct protocol_conn conns[2];
+    for (int c = 0; c < 2; c++) {
+        size_t written = 0;
+        protocol_conn_init(&conns[c], count_write, &written);
+        size_t chunk = c == 0 ? len : 1;
+        int good = 0;
+        int bad = 0;
+        for (size_t offset = 0; offset < len;) {
+            size_t n = len - offset < chunk ? len - offset : chunk;
+            struct protocol_frame frame;
+            offset += protocol_conn_parse(&conns[c], stream + offset, n,
+                                          &frame);
+            if (frame.length > 0 && frame.error == NO_ERROR) {
+                good++;
+            } else if (frame.length > 0) {
+                bad++;
+            }
+        }
+        const struct protocol_stats *stats = protocol_conn_get_stats(&conns[c]);
+        uint32_t errors = 0;
+        for (int e = 0; e < PROTOCOL_ERROR_COUNT; e++) {
+            errors += stats->errors[e];
+        }
+        ok = ok && good == 1 && bad == 2 && stats->stray_markers == 2 &&
+             errors == 0 && stats->resyncs == 1 && stats->bytes_skipped == 1;
+    }
+    char res[] = "29 ";
+    if (ok) {
+        res[2] = 't';
+    } else {
+        res[2] = 'f';
+    }
+    protocol_send(res, 3);
+}
+
+// Keeps the last frame written to a connection
+struct last_write {
+    uint8_t data[PROTOCOL_MAX_FRAME_SIZE];
+    size_t length;
+};
+
+static int keep_write(void *io, const uint8_t *data, size_t len) {
+    struct last_write *last = io;
+    last->length = len <= sizeof(last->data) ? len : 0;
+    memcpy(last->data, data, last->length);
+    return len;
+}
+
+void test30() {
+    // Test 30: Test that the benchmarks run what a 'b' request asks for, skip
+    // what they cannot run, leave the registered handlers as they were, and
+    // answer with one 'b' frame, and that a request that is not whole
+    // records or asks for more than BENCH_MAX benchmarks is refused.
+    int handlers_before = 0;
+    for (int type = 0; type < 256; type++) {
+        handlers_before += protocol_get_handler(type) != NULL;
+    }
+    uint8_t request[] = {BENCH_CRC,      16, 0, 5, 0, 9, 16, 0, 5, 0,
+                         BENCH_DISPATCH, 7,  0, 3, 0};
+    static struct bench_result results[BENCH_MAX];
+    size_t count = bench_run_set(request, sizeof(request), results);
+    int handlers_after = 0;
+    for (int type = 0; type < 256; type++) {
+        handlers_after += protocol_get_handler(type) != NULL;
+    }
+    const struct bench_result *crc = &results[0];
+    bool ok = platform_stopwatch_hz() != 0 && count == 3 &&
+              crc->kind == BENCH_CRC && crc->size == 16 &&
+              crc->iterations == 5 && crc->min_ticks <= crc->max_ticks &&
+              crc->wrapped == 0 &&
+              crc->total_ticks >= 5 * (uint64_t)crc->min_ticks &&
+              crc->total_ticks <= 5 * (uint64_t)crc->max_ticks &&
+              results[1].iterations == 0 && results[2].iterations == 3 &&
+              handlers_before == handlers_after &&
+              protocol_register_handler('b', 0, NULL) == -1;
+
+    static struct protocol_conn conn;
+    static struct last_write last;
+    protocol_conn_init(&conn, keep_write, &last);
+    protocol_conn_set_flush_deadline(&conn, 0);
+    run_benchmarks(&conn, request, sizeof(request));
+    size_t reply_length =
+        7 + BENCH_RESULTS_HEADER_SIZE + 3 * BENCH_RESULT_SIZE;
+    ok = ok && last.length == reply_length && last.data[4] == 'b' &&
+         last.data[5 + BENCH_RESULTS_HEADER_SIZE] == BENCH_CRC;
+    // A partial record is refused
+    run_benchmarks(&conn, request, 4);
+    ok = ok && last.length == 8 && last.data[4] == 'a' &&
+         last.data[5] == LENGTH;
+    // So is one record too many
+    static uint8_t too_many[(BENCH_MAX + 1) * BENCH_REQUEST_SIZE];
+    last.length = 0;
+    run_benchmarks(&conn, too_many, sizeof(too_many));
+    ok = ok && last.length == 8 && last.data[4] == 'a' &&
+         last.data[5] == LENGTH;
+
+    char res[] = "30 ";
+    if (ok) {
+        res[2] = 't';
+    } else {
+        res[2] = 'f';
+    }
+    protocol_send(res, 3);
+}
+
+static int loopback_write(void *io, const uint8_t *data, size_t len) {
+    return protocol_conn_receive_bytes(io, data, len) >= 0 ? len : 0;
+}
+
+void test31() {
+    // Test 31: Test that a maximum frame size too small for any payload is
+    // ignored rather than taken as the frame size of the link.
+    static struct protocol_conn sender;
+    static struct protocol_conn receiver;
+    size_t written = 0;
+    protocol_conn_init(&receiver, count_write, &written);
+    protocol_conn_init(&sender, loopback_write, &receiver);
+    protocol_conn_set_flush_deadline(&sender, 0);
+    uint8_t caps[PROTOCOL_CAPS_SIZE] = {
+        0, 2, 2, 0, 5, 1, PROTOCOL_CHECKSUM_CRC8, PROTOCOL_COMPRESSION_NONE,
+        PROTOCOL_FRAMING_MARKERS};
+    protocol_conn_send_typed(&sender, 'o', caps, sizeof(caps));
+    bool ok = receiver.connected == 1 &&
+              protocol_conn_frame_size(&receiver) == PROTOCOL_MAX_FRAME_SIZE;
+    // A usable size is still taken
+    caps[4] = PROTOCOL_MIN_FRAME_SIZE;
+    protocol_conn_send_typed(&sender, 'o', caps, sizeof(caps));
+    ok = ok && protocol_conn_frame_size(&receiver) == PROTOCOL_MIN_FRAME_SIZE;
+
+    char res[] = "31 ";
+    if (ok) {
+        res[2] = 't';
+    } else {
+        res[2] = 'f';
+    }
+    protocol_send(res, 3);
+}
+
+void test32() {
+    // Test 32: Test that protocol_poll flushes buffered output once its flush
+    // deadline has passed, and leaves it alone without a deadline.
+    uint32_t deadline_us = 10000;
+    uint8_t payload[] = {0x00, 0x01};
+    protocol_set_flush_deadline(deadline_us);
+    protocol_send(payload, 2);
+    uint64_t sent = platform_time_us();
+    bool ok = protocol_poll() == 0 && protocol_pending() == 9;
+    while (platform_time_us() < sent + deadline_us) {
+    }
+    ok = ok && protocol_poll() == 9 && protocol_pending() == 0;
+
+    protocol_set_flush_deadline(PROTOCOL_NO_DEADLINE);
+    protocol_send(payload, 2);
+    sent = platform_time_us();
+    while (platform_time_us() < sent + deadline_us) {
+    }
+    ok = ok && protocol_poll() == 0 && protocol_pending() == 9;
+    protocol_flush();
+
+    char res[] = "32 ";
+    if (ok) {
         res[2] = 't';
     } else {
         res[2] = 'f';
     }
+    protocol_set_flush_deadline(PROTOCOL_FLUSH_DEADLINE_US);
     protocol_send(res, 3);
 }